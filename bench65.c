@@ -0,0 +1,1133 @@
+/* bench65: a cycle-counting 65C02 emulator with just enough of a BBC
+   Master around it to run the benchmark build of the game (render.c with
+   BENCHMARK defined, see mkbench.sh), and report what each benchmarked
+   routine cost.
+
+   The game says what it's timing by writing to a few addresses in FRED
+   (see run_benchmarks in render.c): the address of the benchmark's name,
+   then BENCH_START, the call, then BENCH_STOP.  Cycles are counted from
+   one write to the other, less the "overhead" benchmark (which times
+   nothing), so each count is exactly what the call costs on a 2MHz
+   65C12.
+
+   With -r, it plays a replay instead (in a REPLAY build), and reports the
+   cycles each move and each cascade took, not counting time spent waiting
+   for the frame clock (between TRACE_IDLE_START and TRACE_IDLE_END).
+
+   The machine is cut down to what the game touches: 32K of main RAM (and
+   shadow RAM, selected with ACCCON), sideways RAM banks 4-7 paged with
+   ROMSEL, and some slow I/O.  There is no MOS: calls to the OS entry
+   points return straight away (OSWORD 10 returns a made-up character
+   definition, and OSFILE only loads the replay), so their cost isn't
+   counted.  Accesses to the 1MHz bus are stretched as on the real machine.
+   Only replays get interrupts: the vsync event, every 20ms, goes straight
+   to EVNTV, without the cost of the MOS's interrupt handler.  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef unsigned char uint8_t;
+typedef signed char int8_t;
+typedef unsigned short uint16_t;
+
+#define BENCH_NAME 0xfc10
+#define BENCH_START 0xfc12
+#define BENCH_STOP 0xfc13
+#define BENCH_DONE 0xfc14
+#define TRACE_MOVE_START 0xfc15
+#define TRACE_MOVE_END 0xfc16
+#define TRACE_CASCADE_START 0xfc17
+#define TRACE_CASCADE_END 0xfc18
+#define TRACE_IDLE_START 0xfc19
+#define TRACE_IDLE_END 0xfc1a
+#define TRACE_REPLAY_END 0xfc1b
+
+#define ROMSEL 0xfe30
+#define ACCCON 0xfe34
+#define ACCCON_X 4
+
+#define OSFILE 0xffdd
+#define OSRDCH 0xffe0
+#define OSASCI 0xffe3
+#define OSWRCH 0xffee
+#define OSWORD 0xfff1
+#define OSBYTE 0xfff4
+#define OSCLI 0xfff7
+#define EVNTV 0x220
+
+/* Entry points with nothing behind them, to finish an event.  */
+#define TRAP_RTS 0xff00
+#define TRAP_EVENT_RETURN 0xff01
+#define FIRST_TRAP TRAP_RTS
+
+/* A 50Hz frame, at 2MHz.  */
+#define FRAME_CYCLES 40000
+
+#define MAX_CYCLES 2000000000ULL
+
+#define MAX_BENCH 64
+#define NAME_LEN 40
+
+#define FLAG_C 0x01
+#define FLAG_Z 0x02
+#define FLAG_I 0x04
+#define FLAG_D 0x08
+#define FLAG_B 0x10
+#define FLAG_U 0x20
+#define FLAG_V 0x40
+#define FLAG_N 0x80
+
+static uint8_t ram[0x8000];
+static uint8_t shadow[0x5000];
+static uint8_t swram[4][0x4000];
+static uint8_t romsel, acccon;
+
+static uint8_t a, x, y, s, p;
+static uint16_t pc;
+static unsigned long long cycles;
+
+static char bench_name[MAX_BENCH][NAME_LEN];
+static unsigned long long bench_cycles[MAX_BENCH];
+static unsigned num_bench;
+static uint16_t name_addr;
+static unsigned long long start_cycles;
+static int running = 1;
+
+/* Replays.  */
+static const char *replay_file;
+static unsigned long long next_vsync = FRAME_CYCLES, frames;
+static int in_event;
+static uint8_t event_a, event_x, event_y, event_p;
+static uint16_t event_pc;
+
+/* The cycles spent idle, and a running total, max and count of the
+   cycles in moves and cascades (less any idle time in them).  */
+struct span
+{
+  unsigned long long start, idle_at_start, total, max, count;
+};
+
+static unsigned long long idle_cycles, idle_from;
+static struct span move_span, cascade_span;
+
+/* Reading memory, without any of the side effects or costs of doing it
+   from the CPU.  */
+
+static uint8_t *
+mem_ptr (uint16_t addr)
+{
+  static uint8_t unmapped;
+
+  if (addr >= 0x3000 && addr < 0x8000 && (acccon & ACCCON_X))
+    return &shadow[addr - 0x3000];
+  if (addr < 0x8000)
+    return &ram[addr];
+  if (addr < 0xc000)
+    {
+      uint8_t bank = romsel & 15;
+      if (bank >= 4 && bank <= 7)
+        return &swram[bank - 4][addr - 0x8000];
+    }
+
+  unmapped = 0xff;
+  return &unmapped;
+}
+
+static uint8_t
+peek (uint16_t addr)
+{
+  return *mem_ptr (addr);
+}
+
+/* Whether ADDR is on the 1MHz bus.  FRED, JIM, the CRTC, ACIA, serial ULA,
+   VIAs and the rest of SHEILA above the VIAs are; the video ULA, ROMSEL
+   and ACCCON aren't.  Our own registers aren't really there, so they
+   aren't either.  */
+
+static int
+slow_io (uint16_t addr)
+{
+  if (addr >= BENCH_NAME && addr <= TRACE_REPLAY_END)
+    return 0;
+  if (addr >= 0xfc00 && addr < 0xfe00)
+    return 1;
+  if (addr >= 0xfe00 && addr < 0xfe20)
+    return 1;
+  if (addr >= 0xfe40 && addr < 0xff00)
+    return 1;
+  return 0;
+}
+
+/* A 1MHz access waits for the next 1MHz cycle to start and takes a whole
+   one: one or two extra 2MHz cycles, depending on where we are.  */
+
+static void
+stretch (uint16_t addr)
+{
+  if (slow_io (addr))
+    cycles += 1 + (cycles & 1);
+}
+
+static void
+span_start (struct span *span)
+{
+  span->start = cycles;
+  span->idle_at_start = idle_cycles;
+}
+
+static void
+span_end (struct span *span)
+{
+  unsigned long long busy = cycles - span->start
+                            - (idle_cycles - span->idle_at_start);
+
+  span->total += busy;
+  if (busy > span->max)
+    span->max = busy;
+  span->count++;
+}
+
+static void
+bench_write (uint16_t addr, uint8_t val)
+{
+  unsigned i;
+
+  switch (addr)
+    {
+    case BENCH_NAME:
+      name_addr = (name_addr & 0xff00) | val;
+      break;
+
+    case BENCH_NAME + 1:
+      name_addr = (name_addr & 0xff) | (val << 8);
+      break;
+
+    case BENCH_START:
+      if (num_bench == MAX_BENCH)
+        {
+          fprintf (stderr, "too many benchmarks\n");
+          exit (1);
+        }
+      for (i = 0; i < NAME_LEN - 1 && peek (name_addr + i); i++)
+        bench_name[num_bench][i] = peek (name_addr + i);
+      bench_name[num_bench][i] = 0;
+      start_cycles = cycles;
+      break;
+
+    case BENCH_STOP:
+      bench_cycles[num_bench++] = cycles - start_cycles;
+      break;
+
+    case BENCH_DONE:
+    case TRACE_REPLAY_END:
+      running = 0;
+      break;
+
+    case TRACE_MOVE_START:
+      span_start (&move_span);
+      break;
+
+    case TRACE_MOVE_END:
+      span_end (&move_span);
+      break;
+
+    case TRACE_CASCADE_START:
+      span_start (&cascade_span);
+      break;
+
+    case TRACE_CASCADE_END:
+      span_end (&cascade_span);
+      break;
+
+    case TRACE_IDLE_START:
+      idle_from = cycles;
+      break;
+
+    case TRACE_IDLE_END:
+      idle_cycles += cycles - idle_from;
+      break;
+    }
+}
+
+static uint8_t
+rd (uint16_t addr)
+{
+  cycles++;
+
+  if (addr >= 0xfc00 && addr < 0xff00)
+    {
+      stretch (addr);
+      if (addr == ROMSEL)
+        return romsel;
+      if (addr == ACCCON)
+        return acccon;
+      return 0;
+    }
+
+  return peek (addr);
+}
+
+static void
+wr (uint16_t addr, uint8_t val)
+{
+  cycles++;
+
+  if (addr >= 0xfc00 && addr < 0xff00)
+    {
+      stretch (addr);
+      if (addr == ROMSEL)
+        romsel = val;
+      else if (addr == ACCCON)
+        acccon = val;
+      else
+        bench_write (addr, val);
+      return;
+    }
+
+  /* The MOS ROM, and paged ROMs.  */
+  if (addr >= 0xc000 || (addr >= 0x8000 && ((romsel & 15) < 4
+                                            || (romsel & 15) > 7)))
+    return;
+
+  *mem_ptr (addr) = val;
+}
+
+/* The CPU.  Each instruction's cycles are counted as its memory accesses
+   plus the internal cycles listed with it, which gives the 65C02's
+   timings (including its extra cycle for decimal ADC and SBC, and for
+   indexing across a page on reads only).  */
+
+static uint8_t
+fetch (void)
+{
+  return rd (pc++);
+}
+
+static uint16_t
+fetch_word (void)
+{
+  uint8_t lo = fetch ();
+  return lo | (fetch () << 8);
+}
+
+static void
+push (uint8_t val)
+{
+  wr (0x100 + s--, val);
+}
+
+static uint8_t
+pull (void)
+{
+  return rd (0x100 + ++s);
+}
+
+static void
+set_nz (uint8_t val)
+{
+  p = (p & ~(FLAG_N | FLAG_Z)) | (val & FLAG_N) | (val ? 0 : FLAG_Z);
+}
+
+static void
+page_penalty (uint16_t base, uint16_t addr)
+{
+  if ((base ^ addr) & 0xff00)
+    cycles++;
+}
+
+/* Addressing modes, giving the effective address.  READ is set for
+   instructions which only read, which skip the extra cycle when indexing
+   doesn't cross a page.  */
+
+static uint16_t
+am_zp (void)
+{
+  return fetch ();
+}
+
+static uint16_t
+am_zpx (void)
+{
+  uint8_t zp = fetch ();
+  cycles++;
+  return (zp + x) & 0xff;
+}
+
+static uint16_t
+am_zpy (void)
+{
+  uint8_t zp = fetch ();
+  cycles++;
+  return (zp + y) & 0xff;
+}
+
+static uint16_t
+am_abs (void)
+{
+  return fetch_word ();
+}
+
+static uint16_t
+am_absi (uint8_t index, int read)
+{
+  uint16_t base = fetch_word (), addr = base + index;
+
+  if (read)
+    page_penalty (base, addr);
+  else
+    cycles++;
+  return addr;
+}
+
+static uint16_t
+zp_word (uint8_t zp)
+{
+  uint8_t lo = rd (zp);
+  return lo | (rd ((zp + 1) & 0xff) << 8);
+}
+
+static uint16_t
+am_indx (void)
+{
+  uint8_t zp = fetch () + x;
+  cycles++;
+  return zp_word (zp);
+}
+
+static uint16_t
+am_indy (int read)
+{
+  uint16_t base = zp_word (fetch ()), addr = base + y;
+
+  if (read)
+    page_penalty (base, addr);
+  else
+    cycles++;
+  return addr;
+}
+
+static uint16_t
+am_indzp (void)
+{
+  return zp_word (fetch ());
+}
+
+static void
+adc (uint8_t m)
+{
+  unsigned c = p & FLAG_C, result;
+
+  if (p & FLAG_D)
+    {
+      int lo = (a & 15) + (m & 15) + c, sum;
+
+      if (lo >= 10)
+        lo = ((lo + 6) & 15) + 16;
+      sum = (a & 0xf0) + (m & 0xf0) + lo;
+      p &= ~(FLAG_V | FLAG_C);
+      if (((int8_t) (a & 0xf0) + (int8_t) (m & 0xf0) + lo) < -128
+          || ((int8_t) (a & 0xf0) + (int8_t) (m & 0xf0) + lo) > 127)
+        p |= FLAG_V;
+      if (sum >= 0xa0)
+        sum += 0x60;
+      if (sum >= 0x100)
+        p |= FLAG_C;
+      a = sum;
+      set_nz (a);
+      cycles++;
+      return;
+    }
+
+  result = a + m + c;
+  p &= ~(FLAG_V | FLAG_C);
+  if (~(a ^ m) & (a ^ result) & 0x80)
+    p |= FLAG_V;
+  if (result > 255)
+    p |= FLAG_C;
+  a = result;
+  set_nz (a);
+}
+
+static void
+sbc (uint8_t m)
+{
+  if (p & FLAG_D)
+    {
+      int borrow = !(p & FLAG_C);
+      int lo = (a & 15) - (m & 15) - borrow;
+      int diff = a - m - borrow;
+      unsigned binary = a - m - borrow;
+
+      p &= ~(FLAG_V | FLAG_C);
+      if ((a ^ m) & (a ^ binary) & 0x80)
+        p |= FLAG_V;
+      if (diff >= 0)
+        p |= FLAG_C;
+      if (diff < 0)
+        diff -= 0x60;
+      if (lo < 0)
+        diff -= 0x06;
+      a = diff;
+      set_nz (a);
+      cycles++;
+      return;
+    }
+
+  adc (~m);
+}
+
+static void
+compare (uint8_t reg, uint8_t m)
+{
+  p = (p & ~FLAG_C) | (reg >= m ? FLAG_C : 0);
+  set_nz (reg - m);
+}
+
+static void
+branch (int taken)
+{
+  int8_t offset = fetch ();
+  uint16_t target;
+
+  if (!taken)
+    return;
+
+  target = pc + offset;
+  cycles++;
+  page_penalty (pc, target);
+  pc = target;
+}
+
+static uint8_t
+asl (uint8_t m)
+{
+  p = (p & ~FLAG_C) | (m >> 7);
+  m <<= 1;
+  set_nz (m);
+  return m;
+}
+
+static uint8_t
+lsr (uint8_t m)
+{
+  p = (p & ~FLAG_C) | (m & 1);
+  m >>= 1;
+  set_nz (m);
+  return m;
+}
+
+static uint8_t
+rol (uint8_t m)
+{
+  uint8_t c = p & FLAG_C;
+  p = (p & ~FLAG_C) | (m >> 7);
+  m = (m << 1) | c;
+  set_nz (m);
+  return m;
+}
+
+static uint8_t
+ror (uint8_t m)
+{
+  uint8_t c = p & FLAG_C;
+  p = (p & ~FLAG_C) | (m & 1);
+  m = (m >> 1) | (c << 7);
+  set_nz (m);
+  return m;
+}
+
+static void
+bit (uint8_t m, int immediate)
+{
+  p = (p & ~FLAG_Z) | ((a & m) ? 0 : FLAG_Z);
+  if (!immediate)
+    p = (p & ~(FLAG_N | FLAG_V)) | (m & (FLAG_N | FLAG_V));
+}
+
+/* Read-modify-write: the 65C02 reads the operand twice rather than
+   writing it twice, which costs the same.  */
+#define RMW(ADDR, OP)				\
+  do						\
+    {						\
+      uint16_t ea_ = (ADDR);			\
+      uint8_t m_ = rd (ea_);			\
+      cycles++;					\
+      wr (ea_, OP (m_));			\
+    }						\
+  while (0)
+
+static uint8_t
+inc (uint8_t m)
+{
+  set_nz (++m);
+  return m;
+}
+
+static uint8_t
+dec (uint8_t m)
+{
+  set_nz (--m);
+  return m;
+}
+
+static void
+load (const char *filename, uint8_t *dest, size_t size)
+{
+  FILE *f = fopen (filename, "rb");
+
+  if (!f)
+    {
+      perror (filename);
+      exit (1);
+    }
+
+  if (fread (dest, 1, size, f) == size && fgetc (f) != EOF)
+    {
+      fprintf (stderr, "%s: too big\n", filename);
+      exit (1);
+    }
+
+  fclose (f);
+}
+
+/* Load a file into the emulated memory, as OSFILE would.  */
+
+static void
+load_to (const char *filename, uint16_t addr)
+{
+  FILE *f = fopen (filename, "rb");
+  int c;
+
+  if (!f)
+    {
+      perror (filename);
+      exit (1);
+    }
+
+  while ((c = fgetc (f)) != EOF)
+    *mem_ptr (addr++) = c;
+
+  fclose (f);
+}
+
+/* The OS, such as it is.  */
+
+static void
+os_call (uint16_t entry)
+{
+  uint16_t block = x | (y << 8);
+  unsigned i;
+
+  switch (entry)
+    {
+    case TRAP_EVENT_RETURN:
+      /* As RTI, back to wherever the event interrupted.  */
+      a = event_a;
+      x = event_x;
+      y = event_y;
+      p = event_p;
+      pc = event_pc;
+      in_event = 0;
+      cycles += 6;
+      return;
+
+    case OSFILE:
+      /* Load the replay, wherever it's asked for.  */
+      if (a == 255 && replay_file && peek (block + 6) == 0)
+        load_to (replay_file, peek (block + 2) | (peek (block + 3) << 8));
+      break;
+
+    case OSWORD:
+      /* Read character definition: a pattern made from the code, so that
+         big_text has something to draw.  */
+      if (a == 10)
+        {
+          uint8_t c = peek (block);
+          for (i = 1; i <= 8; i++)
+            *mem_ptr (block + i) = (uint8_t) (c * 37 + i * 11) | 0x18;
+        }
+      break;
+
+    case OSBYTE:
+      /* INKEY: nothing pressed.  */
+      if (a == 129)
+        {
+          y = 0xff;
+          p |= FLAG_C;
+        }
+      /* Wait for vsync, idly.  */
+      else if (a == 19 && replay_file && cycles < next_vsync)
+        {
+          idle_cycles += next_vsync - cycles;
+          cycles = next_vsync;
+        }
+      break;
+
+    case OSRDCH:
+      a = 13;
+      p &= ~FLAG_C;
+      break;
+    }
+
+  /* RTS.  */
+  cycles += 3;
+  pc = pull ();
+  pc |= pull () << 8;
+  pc++;
+  cycles++;
+}
+
+/* Take the vsync event, if it's due and interrupts are enabled.  The MOS
+   would call EVNTV with A = 4 from its interrupt handler.  */
+
+static void
+vsync (void)
+{
+  if (cycles < next_vsync || in_event || (p & FLAG_I))
+    return;
+
+  next_vsync += FRAME_CYCLES;
+  frames++;
+
+  event_a = a;
+  event_x = x;
+  event_y = y;
+  event_p = p;
+  event_pc = pc;
+  in_event = 1;
+
+  /* The interrupt itself, then a JSR to the handler.  */
+  cycles += 7 + 6;
+  push ((TRAP_EVENT_RETURN - 1) >> 8);
+  push ((TRAP_EVENT_RETURN - 1) & 255);
+  p |= FLAG_I;
+  a = 4;
+  pc = peek (EVNTV) | (peek (EVNTV + 1) << 8);
+}
+
+static void
+step (void)
+{
+  uint8_t op, m;
+  uint16_t addr;
+
+  if (pc >= FIRST_TRAP)
+    {
+      os_call (pc);
+      return;
+    }
+
+  op = fetch ();
+
+  switch (op)
+    {
+    /* Loads and stores.  */
+    case 0xa9: a = fetch (); set_nz (a); break;
+    case 0xa5: a = rd (am_zp ()); set_nz (a); break;
+    case 0xb5: a = rd (am_zpx ()); set_nz (a); break;
+    case 0xad: a = rd (am_abs ()); set_nz (a); break;
+    case 0xbd: a = rd (am_absi (x, 1)); set_nz (a); break;
+    case 0xb9: a = rd (am_absi (y, 1)); set_nz (a); break;
+    case 0xa1: a = rd (am_indx ()); set_nz (a); break;
+    case 0xb1: a = rd (am_indy (1)); set_nz (a); break;
+    case 0xb2: a = rd (am_indzp ()); set_nz (a); break;
+
+    case 0xa2: x = fetch (); set_nz (x); break;
+    case 0xa6: x = rd (am_zp ()); set_nz (x); break;
+    case 0xb6: x = rd (am_zpy ()); set_nz (x); break;
+    case 0xae: x = rd (am_abs ()); set_nz (x); break;
+    case 0xbe: x = rd (am_absi (y, 1)); set_nz (x); break;
+
+    case 0xa0: y = fetch (); set_nz (y); break;
+    case 0xa4: y = rd (am_zp ()); set_nz (y); break;
+    case 0xb4: y = rd (am_zpx ()); set_nz (y); break;
+    case 0xac: y = rd (am_abs ()); set_nz (y); break;
+    case 0xbc: y = rd (am_absi (x, 1)); set_nz (y); break;
+
+    case 0x85: wr (am_zp (), a); break;
+    case 0x95: wr (am_zpx (), a); break;
+    case 0x8d: wr (am_abs (), a); break;
+    case 0x9d: wr (am_absi (x, 0), a); break;
+    case 0x99: wr (am_absi (y, 0), a); break;
+    case 0x81: wr (am_indx (), a); break;
+    case 0x91: wr (am_indy (0), a); break;
+    case 0x92: wr (am_indzp (), a); break;
+
+    case 0x86: wr (am_zp (), x); break;
+    case 0x96: wr (am_zpy (), x); break;
+    case 0x8e: wr (am_abs (), x); break;
+
+    case 0x84: wr (am_zp (), y); break;
+    case 0x94: wr (am_zpx (), y); break;
+    case 0x8c: wr (am_abs (), y); break;
+
+    case 0x64: wr (am_zp (), 0); break;
+    case 0x74: wr (am_zpx (), 0); break;
+    case 0x9c: wr (am_abs (), 0); break;
+    case 0x9e: wr (am_absi (x, 0), 0); break;
+
+    /* Transfers.  */
+    case 0xaa: cycles++; x = a; set_nz (x); break;
+    case 0xa8: cycles++; y = a; set_nz (y); break;
+    case 0x8a: cycles++; a = x; set_nz (a); break;
+    case 0x98: cycles++; a = y; set_nz (a); break;
+    case 0xba: cycles++; x = s; set_nz (x); break;
+    case 0x9a: cycles++; s = x; break;
+
+    /* The stack.  */
+    case 0x48: cycles++; push (a); break;
+    case 0xda: cycles++; push (x); break;
+    case 0x5a: cycles++; push (y); break;
+    case 0x08: cycles++; push (p | FLAG_B | FLAG_U); break;
+    case 0x68: cycles += 2; a = pull (); set_nz (a); break;
+    case 0xfa: cycles += 2; x = pull (); set_nz (x); break;
+    case 0x7a: cycles += 2; y = pull (); set_nz (y); break;
+    case 0x28: cycles += 2; p = pull () | FLAG_U; break;
+
+    /* Arithmetic and logic.  */
+#define ALU(BASE, OP)							\
+    case BASE + 0x09: OP (fetch ()); break;				\
+    case BASE + 0x05: OP (rd (am_zp ())); break;			\
+    case BASE + 0x15: OP (rd (am_zpx ())); break;			\
+    case BASE + 0x0d: OP (rd (am_abs ())); break;			\
+    case BASE + 0x1d: OP (rd (am_absi (x, 1))); break;			\
+    case BASE + 0x19: OP (rd (am_absi (y, 1))); break;			\
+    case BASE + 0x01: OP (rd (am_indx ())); break;			\
+    case BASE + 0x11: OP (rd (am_indy (1))); break;			\
+    case BASE + 0x12: OP (rd (am_indzp ())); break;
+
+#define ORA(M) (a |= (M), set_nz (a))
+#define AND(M) (a &= (M), set_nz (a))
+#define EOR(M) (a ^= (M), set_nz (a))
+#define CMP(M) compare (a, (M))
+
+    ALU (0x00, ORA)
+    ALU (0x20, AND)
+    ALU (0x40, EOR)
+    ALU (0x60, adc)
+    ALU (0xc0, CMP)
+    ALU (0xe0, sbc)
+
+    case 0xe0: compare (x, fetch ()); break;
+    case 0xe4: compare (x, rd (am_zp ())); break;
+    case 0xec: compare (x, rd (am_abs ())); break;
+    case 0xc0: compare (y, fetch ()); break;
+    case 0xc4: compare (y, rd (am_zp ())); break;
+    case 0xcc: compare (y, rd (am_abs ())); break;
+
+    case 0x89: bit (fetch (), 1); break;
+    case 0x24: bit (rd (am_zp ()), 0); break;
+    case 0x34: bit (rd (am_zpx ()), 0); break;
+    case 0x2c: bit (rd (am_abs ()), 0); break;
+    case 0x3c: bit (rd (am_absi (x, 1)), 0); break;
+
+    /* Shifts, increments and decrements.  The 65C02 only takes the extra
+       cycle for shifts indexed across a page, but always for INC and DEC.  */
+#define SHIFT(BASE, OP)							\
+    case BASE + 0x0a: cycles++; a = OP (a); break;			\
+    case BASE + 0x06: RMW (am_zp (), OP); break;			\
+    case BASE + 0x16: RMW (am_zpx (), OP); break;			\
+    case BASE + 0x0e: RMW (am_abs (), OP); break;			\
+    case BASE + 0x1e: RMW (am_absi (x, 1), OP); break;
+
+    SHIFT (0x00, asl)
+    SHIFT (0x20, rol)
+    SHIFT (0x40, lsr)
+    SHIFT (0x60, ror)
+
+    case 0x1a: cycles++; a = inc (a); break;
+    case 0xe6: RMW (am_zp (), inc); break;
+    case 0xf6: RMW (am_zpx (), inc); break;
+    case 0xee: RMW (am_abs (), inc); break;
+    case 0xfe: RMW (am_absi (x, 0), inc); break;
+    case 0x3a: cycles++; a = dec (a); break;
+    case 0xc6: RMW (am_zp (), dec); break;
+    case 0xd6: RMW (am_zpx (), dec); break;
+    case 0xce: RMW (am_abs (), dec); break;
+    case 0xde: RMW (am_absi (x, 0), dec); break;
+
+    case 0xe8: cycles++; set_nz (++x); break;
+    case 0xc8: cycles++; set_nz (++y); break;
+    case 0xca: cycles++; set_nz (--x); break;
+    case 0x88: cycles++; set_nz (--y); break;
+
+    /* Test and set or reset bits.  */
+    case 0x04: case 0x0c: case 0x14: case 0x1c:
+      addr = (op & 8) ? am_abs () : am_zp ();
+      m = rd (addr);
+      cycles++;
+      p = (p & ~FLAG_Z) | ((a & m) ? 0 : FLAG_Z);
+      wr (addr, (op & 0x10) ? m & ~a : m | a);
+      break;
+
+    /* Flags.  */
+    case 0x18: cycles++; p &= ~FLAG_C; break;
+    case 0x38: cycles++; p |= FLAG_C; break;
+    case 0x58: cycles++; p &= ~FLAG_I; break;
+    case 0x78: cycles++; p |= FLAG_I; break;
+    case 0xb8: cycles++; p &= ~FLAG_V; break;
+    case 0xd8: cycles++; p &= ~FLAG_D; break;
+    case 0xf8: cycles++; p |= FLAG_D; break;
+
+    /* Branches and jumps.  */
+    case 0x10: branch (!(p & FLAG_N)); break;
+    case 0x30: branch (p & FLAG_N); break;
+    case 0x50: branch (!(p & FLAG_V)); break;
+    case 0x70: branch (p & FLAG_V); break;
+    case 0x90: branch (!(p & FLAG_C)); break;
+    case 0xb0: branch (p & FLAG_C); break;
+    case 0xd0: branch (!(p & FLAG_Z)); break;
+    case 0xf0: branch (p & FLAG_Z); break;
+    case 0x80: branch (1); break;
+
+    case 0x4c:
+      pc = fetch_word ();
+      break;
+
+    case 0x6c:
+      addr = fetch_word ();
+      cycles++;
+      pc = rd (addr) | (rd (addr + 1) << 8);
+      break;
+
+    case 0x7c:
+      addr = fetch_word () + x;
+      cycles++;
+      pc = rd (addr) | (rd (addr + 1) << 8);
+      break;
+
+    case 0x20:
+      addr = fetch ();
+      cycles++;
+      push (pc >> 8);
+      push (pc & 255);
+      pc = addr | (fetch () << 8);
+      break;
+
+    case 0x60:
+      cycles += 2;
+      pc = pull ();
+      pc |= pull () << 8;
+      pc++;
+      cycles++;
+      break;
+
+    case 0x40:
+      cycles += 2;
+      p = pull () | FLAG_U;
+      pc = pull ();
+      pc |= pull () << 8;
+      break;
+
+    case 0x00:
+      fprintf (stderr, "BRK at &%04X\n", pc - 1);
+      exit (1);
+
+    case 0xea: cycles++; break;
+
+    /* Everything else is a NOP of some sort on the 65C12.  */
+    case 0x02: case 0x22: case 0x42: case 0x62: case 0x82: case 0xc2:
+    case 0xe2:
+      fetch ();
+      break;
+
+    case 0x44:
+      rd (am_zp ());
+      break;
+
+    case 0x54: case 0xd4: case 0xf4:
+      rd (am_zpx ());
+      break;
+
+    case 0x5c:
+      fetch_word ();
+      cycles += 5;
+      break;
+
+    case 0xdc: case 0xfc:
+      rd (am_abs ());
+      break;
+
+    default:
+      /* xxxxxx11: one byte, one cycle.  */
+      break;
+    }
+}
+
+/* Put a replay's results in the table with the benchmarks'.  */
+
+static void
+add_result (const char *name, unsigned long long value)
+{
+  if (num_bench == MAX_BENCH)
+    return;
+  strcpy (bench_name[num_bench], name);
+  bench_cycles[num_bench++] = value;
+}
+
+static int
+find_baseline (FILE *f, const char *name, unsigned long long *cycles_out)
+{
+  char line[128], bname[NAME_LEN];
+  unsigned long long bcycles;
+
+  rewind (f);
+  while (fgets (line, sizeof (line), f))
+    if (line[0] != '#'
+        && sscanf (line, "%39[^\t]\t%llu", bname, &bcycles) == 2
+        && !strcmp (bname, name))
+      {
+        *cycles_out = bcycles;
+        return 1;
+      }
+
+  return 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+  const char *tiles = "tiles", *sprites = "sprites", *baseline = NULL;
+  unsigned long long overhead = 0, was, net;
+  int update = 0, regressions = 0, missing = 0, opt;
+  FILE *bf = NULL;
+  unsigned i, first = 0;
+
+  while ((opt = getopt (argc, argv, "t:s:b:ur:")) != -1)
+    switch (opt)
+      {
+      case 't':
+        tiles = optarg;
+        break;
+      case 's':
+        sprites = optarg;
+        break;
+      case 'b':
+        baseline = optarg;
+        break;
+      case 'u':
+        update = 1;
+        break;
+      case 'r':
+        replay_file = optarg;
+        break;
+      default:
+        goto usage;
+      }
+
+  if (optind != argc - 1 || (update && !baseline))
+    {
+    usage:
+      fprintf (stderr, "usage: %s [-t tiles] [-s sprites] [-r replay]"
+               " [-b baseline [-u]] rom\n", argv[0]);
+      return 1;
+    }
+
+  /* As !boot leaves things: the tiles at &E00, the game in bank 4 and the
+     sprites in bank 5.  */
+  load (argv[optind], swram[0], sizeof (swram[0]));
+  load (tiles, &ram[0xe00], 0x8000 - 0xe00);
+  load (sprites, swram[1], sizeof (swram[1]));
+  romsel = ram[0xf4] = 4;
+  ram[EVNTV] = TRAP_RTS & 255;
+  ram[EVNTV + 1] = TRAP_RTS >> 8;
+
+  /* Enter through the service entry, as for auto-boot.  */
+  pc = 0x8003;
+  a = 3;
+  s = 0xff;
+  p = FLAG_U | FLAG_I;
+
+  while (running)
+    {
+      if (cycles > MAX_CYCLES)
+        {
+          fprintf (stderr, "still running at &%04X after %llu cycles\n", pc,
+                   cycles);
+          return 1;
+        }
+      if (replay_file)
+        vsync ();
+      step ();
+    }
+
+  if (replay_file)
+    {
+      printf ("# %llu moves, %llu cascades, %llu frames\n", move_span.count,
+              cascade_span.count, frames);
+      add_result ("cycles/move", move_span.count
+                                 ? move_span.total / move_span.count : 0);
+      add_result ("max cycles/move", move_span.max);
+      add_result ("cycles/cascade", cascade_span.count
+                                    ? cascade_span.total / cascade_span.count
+                                    : 0);
+      add_result ("max cycles/cascade", cascade_span.max);
+      add_result ("busy cycles", cycles - idle_cycles);
+    }
+
+  if (num_bench && !strcmp (bench_name[0], "overhead"))
+    {
+      overhead = bench_cycles[0];
+      first = 1;
+    }
+
+  if (baseline && !update)
+    {
+      bf = fopen (baseline, "r");
+      if (!bf)
+        {
+          perror (baseline);
+          return 1;
+        }
+    }
+
+  printf ("# routine\tcycles\tbaseline\tchange\n");
+  for (i = first; i < num_bench; i++)
+    {
+      net = bench_cycles[i] - overhead;
+      printf ("%s\t%llu", bench_name[i], net);
+      if (bf && find_baseline (bf, bench_name[i], &was))
+        {
+          printf ("\t%llu\t%+lld", was, (long long) (net - was));
+          if (net > was)
+            {
+              printf ("\tREGRESSION");
+              regressions++;
+            }
+        }
+      else if (bf)
+        {
+          printf ("\t-\t-\tNO BASELINE");
+          missing++;
+        }
+      else
+        printf ("\t-\t-");
+      printf ("\n");
+    }
+
+  if (bf)
+    fclose (bf);
+
+  if (update)
+    {
+      bf = fopen (baseline, "w");
+      if (!bf)
+        {
+          perror (baseline);
+          return 1;
+        }
+      fprintf (bf, "# routine\tcycles (see mkbench.sh)\n");
+      for (i = first; i < num_bench; i++)
+        fprintf (bf, "%s\t%llu\n", bench_name[i], bench_cycles[i] - overhead);
+      fclose (bf);
+    }
+
+  if (regressions)
+    fprintf (stderr, "%d routine(s) slower than %s\n", regressions, baseline);
+  if (missing)
+    fprintf (stderr, "%d routine(s) missing from %s\n", missing, baseline);
+
+  return regressions || missing;
+}
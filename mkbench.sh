@@ -0,0 +1,58 @@
+#!/bin/bash
+set -e
+
+# Time the hot routines on fixed inputs, in a benchmark build of the game
+# (BENCHMARK in render.c) run on bench65, a cycle-counting 65C02 emulator.
+# Run mkrender.sh first, for the tiles and sprites.  This prints cycles per
+# call next to those in bench.baseline, and fails if anything got slower,
+# or has no baseline.  "./mkbench.sh --record" records the baseline instead
+# (commit it along with the change that moved it).
+#
+# No baseline has been committed yet, so the regression gate is not active:
+# until one is recorded from a real 6502-gcc build, this prints the cycles
+# with nothing to compare them to and fails, saying so.
+#
+# "./mkbench.sh -r FILE" plays back a replay (saved as REPLAY by a build
+# with RECORD defined) in a REPLAY build instead, and gives the cycles per
+# move and per cascade, checked against FILE.baseline in the same way.
+
+GCCFLAGS="-mmach=bbcmaster -T rom.cfg -mcpu=65C02 -Os"
+SOURCES="header.S swram.S bcd.S rules.c render.c"
+STACKTOP=0x40ff
+
+if [ "$1" = "-r" ]; then
+  REPLAY_FILE=$2
+  BASELINE=$REPLAY_FILE.baseline
+  UPDATE=$3
+else
+  BASELINE=bench.baseline
+  UPDATE=$1
+fi
+
+if [ -n "$UPDATE" ] && [ "$UPDATE" != "--record" ]; then
+  echo "usage: $0 [-r FILE] [--record]"
+  exit 1
+fi
+
+cc -O2 -Wall bench65.c -o bench65
+
+if [ -n "$REPLAY_FILE" ]; then
+  6502-gcc $GCCFLAGS -DREPLAY $SOURCES -Wl,-D,__STACKTOP__=$STACKTOP -o render-replay -Wl,-m,render-replay.map
+  ROM="-r $REPLAY_FILE render-replay"
+else
+  6502-gcc $GCCFLAGS -DBENCHMARK $SOURCES -Wl,-D,__STACKTOP__=$STACKTOP -o render-bench -Wl,-m,render-bench.map
+  ROM=render-bench
+fi
+
+if [ -n "$UPDATE" ]; then
+  ./bench65 -t tiles -s sprites -b "$BASELINE" -u $ROM
+  echo "recorded $BASELINE"
+elif [ -f "$BASELINE" ]; then
+  ./bench65 -t tiles -s sprites -b "$BASELINE" $ROM
+else
+  ./bench65 -t tiles -s sprites $ROM
+  echo "$BASELINE is missing, so nothing was checked: the regression gate is"
+  echo "not active until it is recorded with"
+  echo "\"$0 ${REPLAY_FILE:+-r $REPLAY_FILE }--record\" and committed."
+  exit 1
+fi
@@ -0,0 +1,10 @@
+#!/bin/bash
+set -e
+
+# Build the game rules natively, with the headless harness in sim.c, for
+# profiling them without an emulator.  Run it as
+#   ./sim [-n moves] [-s seed] [tiles.s]
+# where tiles.s is what tileconv writes (see mkrender.sh).
+CC=${CC:-cc}
+
+$CC -O2 -Wall rules.c sim.c -o sim
@@ -3,15 +3,85 @@ set -e
 rm -f rendertest.ssd
 #BBCIM=/home/jules/stuff/chunkydemo2/bbcim/bbcim
 BBCIM=/home/jules/code/chunkydemo/bbcim/bbcim
-./tileconv candy3.gif -o tiles.s
+
+# Tiles to emit as compiled code in the sprite bank (faster to draw, but
+# bigger).  The rest are drawn from RLE data.  Use "none" or "all" too.
+COMPILED_TILES="0-5,25,27"
+
+# Set to 1 for the double-buffered version, which draws into shadow RAM.
+# That moves the stack, and what swram.S needs in main RAM, below &3000
+# (rom-shadow.cfg), so the tiles must end by &2800.  The rest of our
+# variables go after the code in its sideways RAM bank.  Not with RECORD.
+DOUBLE_BUFFER=0
+
+# Bytes kept free below STACKTOP for the stack.
+STACKSIZE=512
+
+# Set to 1 to save a replay of each level to disc as it's played (see
+# mkbench.sh for playing them back).
+RECORD=0
+
+# Set to 1 to time the main sections of the game with the User VIA's timer
+# 2.  Press P during play to step through them on the status line.
+PROFILE=0
+
+if [ "$DOUBLE_BUFFER" = 1 ]; then
+  CFG=rom-shadow.cfg
+  STACKTOP=0x2fff
+  DEFS=-DDOUBLE_BUFFER
+else
+  CFG=rom.cfg
+  STACKTOP=0x40ff
+  DEFS=
+fi
+
+if [ "$RECORD" = 1 ]; then
+  DEFS="$DEFS -DRECORD"
+fi
+
+if [ "$PROFILE" = 1 ]; then
+  DEFS="$DEFS -DPROFILE"
+fi
+
+./tileconv candy3.gif -o tiles.s -s sprites.s -c "$COMPILED_TILES"
 ca65 tiles.s -o tiles.o
 ld65 --config none.cfg -S 0xe00 tiles.o -o tiles
+TILESSIZE=$(wc -c tiles | awk '{print $1}')
+if [ "$DOUBLE_BUFFER" = 1 ] && [ "$TILESSIZE" -gt $((0x2800 - 0xe00)) ]; then
+  echo "tiles too big for double-buffered build: $TILESSIZE"
+  exit 1
+fi
+ca65 sprites.s -o sprites.o
+ld65 --config none.cfg -S 0x8000 sprites.o -o sprites
+
+6502-gcc -mmach=bbcmaster -T $CFG -mcpu=65C02 -Os $DEFS header.S swram.S bcd.S rules.c render.c -Wl,-D,__STACKTOP__=$STACKTOP -o render -save-temps -Wl,-m,render.map
+
+# Check the variables fit: those in main RAM below the stack, and any in
+# the bank (after the code) below &C000.
+map_value ()
+{
+  awk -v sym="$1" '{ for (i = 1; i < NF; i++)
+                       if ($i == sym) { print $(i + 1); exit } }' render.map
+}
 
-6502-gcc -mmach=bbcmaster -T rom.cfg -mcpu=65C02 -Os header.S render.c -Wl,-D,__STACKTOP__=0x40ff -o render -save-temps -Wl,-m,render.map
+for SEG in DATA BSS LOWBSS; do
+  START=$((0x$(map_value __${SEG}_RUN__)))
+  END=$((START + 0x$(map_value __${SEG}_SIZE__)))
+  if [ "$START" -lt $((0x8000)) ]; then
+    LIMIT=$((STACKTOP + 1 - STACKSIZE))
+  else
+    LIMIT=$((0xc000))
+  fi
+  if [ "$END" -gt "$LIMIT" ]; then
+    printf "%s runs to &%X, past &%X\n" $SEG $END $LIMIT
+    exit 1
+  fi
+done
 
 rm -rf tmpdisk
 mkdir tmpdisk
-cp render render.inf "!boot" "!boot.inf" "tiles" "tiles.inf" tmpdisk
+cp render render.inf "!boot" "!boot.inf" "tiles" "tiles.inf" \
+   "sprites" "sprites.inf" tmpdisk
 
 BINSIZE=$(wc -c render | awk '{print $1}')
 echo "binary size: $BINSIZE / 16384"
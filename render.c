@@ -3,39 +3,31 @@
 #include <stdio.h>
 #include <stdlib.h>
 
-typedef unsigned char uint8_t;
-typedef signed char int8_t;
-typedef unsigned short uint16_t;
-
-static uint16_t lfsr = 0xace1u;
-
-#define PLAIN_TILES 0
-#define V_TILES 6
-#define H_TILES 12
-#define WRAP_TILES 18
-#define FIRST_NONCOLOUR 24
-#define SWIRL_TILE 24
-#define CAGE_TILE 25
-#define COLOURBOMB_TILE 26
-#define EXPLOSION_TILE 27
-#define BG_TILES 28
+#include "rules.h"
 
 #define DIGITS_TEXT 32
 #define JELLY_TEXT 33
 #define SCORE_TEXT 34
 #define MOVES_TEXT 35
-#define LEVEL1_PTR 36
-
-#define SWIRL_MASK 0x80
-#define CAGE_MASK  0x40
-#define BG_MASK    0x3f
-
-#define EMPTY_TILE 31
+#define SPRITE_MAP 36
+#define LEVEL1_PTR 37
 
 //#define CHEATMODE 1
 #define ROM
 
-static uint8_t *const screenbase = (uint8_t *) 0x4100;
+/* Draw the tiles tileconv compiled to code (see COMPILED_TILES in
+   mkrender.sh) using that code, rather than the RLE data.  */
+#define COMPILED_TILES
+
+/* Cache composited playfield cells in sideways RAM.  */
+#define TILE_CACHE
+
+/* DOUBLE_BUFFER (set from mkrender.sh, since it needs a different memory
+   layout) draws the playfield into shadow RAM and flips at vsync.  */
+
+#define SCREENBASE 0x4100
+
+static uint8_t *const screenbase = (uint8_t *) SCREENBASE;
 
 #ifdef TILES_LINKED_IN
 extern uint8_t *tiles[];
@@ -47,9 +39,95 @@ uint8_t **tiles = (uint8_t **) 0x8000;
 
 #define ROWLENGTH 576
 
+/* Screen addresses.  All drawing goes through these tables rather than
+   multiplying by ROWLENGTH, since the 6502 has no multiply instruction.  */
+
+#define CHARROW(N) ((uint8_t *) SCREENBASE + (N) * ROWLENGTH)
+
+static uint8_t *const charrow[28] =
+  {
+    CHARROW (0), CHARROW (1), CHARROW (2), CHARROW (3),
+    CHARROW (4), CHARROW (5), CHARROW (6), CHARROW (7),
+    CHARROW (8), CHARROW (9), CHARROW (10), CHARROW (11),
+    CHARROW (12), CHARROW (13), CHARROW (14), CHARROW (15),
+    CHARROW (16), CHARROW (17), CHARROW (18), CHARROW (19),
+    CHARROW (20), CHARROW (21), CHARROW (22), CHARROW (23),
+    CHARROW (24), CHARROW (25), CHARROW (26), CHARROW (27)
+  };
+
+static uint8_t *const cellrow[9] =
+  {
+    CHARROW (0), CHARROW (3), CHARROW (6), CHARROW (9), CHARROW (12),
+    CHARROW (15), CHARROW (18), CHARROW (21), CHARROW (24)
+  };
+
+static const uint16_t cellcol[9] =
+  {
+    0, 64, 128, 192, 256, 320, 384, 448, 512
+  };
+
+#define STATUS_ROW CHARROW (27)
+
+/* Top-left of a playfield cell, and the address of the first byte of
+   scanline Y (in pixels, from the top).  */
+#define CELL_ADDR(X, Y) (cellrow[Y] + cellcol[X])
+#define SCANLINE_ADDR(Y) (charrow[(Y) >> 3] + ((Y) & 7))
+
 #define READ_BYTE(A) (*(volatile uint8_t *) (A))
 #define WRITE_BYTE(A, V) (*(volatile uint8_t *) (A) = (V))
 
+/* Registers in FRED (where the Master has nothing) which bench65 watches,
+   to time benchmarks (BENCHMARK builds) and replays (REPLAY builds).  See
+   mkbench.sh.  */
+#define BENCH_NAME 0xfc10
+#define BENCH_START 0xfc12
+#define BENCH_STOP 0xfc13
+#define BENCH_DONE 0xfc14
+#define TRACE_MOVE_START 0xfc15
+#define TRACE_MOVE_END 0xfc16
+#define TRACE_CASCADE_START 0xfc17
+#define TRACE_CASCADE_END 0xfc18
+#define TRACE_IDLE_START 0xfc19
+#define TRACE_IDLE_END 0xfc1a
+#define TRACE_REPLAY_END 0xfc1b
+
+#ifdef REPLAY
+#define TRACE(REG) WRITE_BYTE (REG, 0)
+#else
+#define TRACE(REG)
+#endif
+
+/* Sections timed in PROFILE builds, in the order the overlay shows them
+   (see prof_begin).  Otherwise the macros leave nothing behind, so the
+   code is the same as with no profiling at all.  PROF_CALL times a call
+   whose result is wanted, e.g. in a loop condition.  */
+#define PROF_REDRAW 0
+#define PROF_MATCH 1
+#define PROF_GRAVITY 2
+#define PROF_RESHUFFLE 3
+#define PROF_HUD 4
+#define PROF_SOUND 5
+#define PROF_SECTIONS 6
+
+#ifdef PROFILE
+static void prof_begin (uint8_t id);
+static void prof_end (uint8_t id);
+#define PROF_BEGIN(ID) prof_begin (ID)
+#define PROF_END(ID) prof_end (ID)
+#define PROF_CALL(ID, EXPR)		\
+  ({					\
+    __typeof__ (EXPR) prof_result_;	\
+    prof_begin (ID);			\
+    prof_result_ = (EXPR);		\
+    prof_end (ID);			\
+    prof_result_;			\
+  })
+#else
+#define PROF_BEGIN(ID)
+#define PROF_END(ID)
+#define PROF_CALL(ID, EXPR) (EXPR)
+#endif
+
 #ifndef TILES_LINKED_IN
 static uint8_t oldbank;
 
@@ -71,18 +149,6 @@ deselect_sram (void)
 }
 #endif
 
-static unsigned int
-rand (void)
-{
-  uint16_t bit;        /* Must be 16bit to allow bit<<15 later in the code */
-
-  /* taps: 16 14 13 11; feedback polynomial: x^16 + x^14 + x^13 + x^11 + 1 */
-  bit  = ((lfsr >> 0) ^ (lfsr >> 2) ^ (lfsr >> 3) ^ (lfsr >> 5) ) & 1;
-  lfsr =  (lfsr >> 1) | (bit << 15);
-
-  return lfsr;
-}
-
 static void
 oswrch (uint8_t x)
 {
@@ -173,6 +239,78 @@ osfile_load (const char *filename, void *address)
   osfile (255);
 }
 
+static void
+osfile_save (const char *filename, void *start, void *end)
+{
+  memset (osfile_params, 0, sizeof (osfile_params));
+  osfile_params[0] = ((unsigned short) filename) & 0xff;
+  osfile_params[1] = (((unsigned short) filename) >> 8) & 0xff;
+  osfile_params[2] = osfile_params[10] = ((unsigned short) start) & 0xff;
+  osfile_params[3] = osfile_params[11] = (((unsigned short) start) >> 8) & 0xff;
+  osfile_params[14] = ((unsigned short) end) & 0xff;
+  osfile_params[15] = (((unsigned short) end) >> 8) & 0xff;
+  osfile (0);
+}
+
+/* Hardware drivers.  These write the video ULA, CRTC and sound chip
+   directly rather than going through the OS, and keep copies of what was
+   written since none of the registers can be read back.  */
+
+#define ULA_PALETTE 0xfe21
+#define CRTC_ADDRESS 0xfe00
+#define CRTC_DATA 0xfe01
+#define USRVIA_T2CL 0xfe68
+#define USRVIA_T2CH 0xfe69
+#define USRVIA_ACR 0xfe6b
+#define USRVIA_IER 0xfe6e
+
+static uint8_t ula_palette[16] =
+  {
+    255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255
+  };
+
+static uint8_t crtc_regs[18];
+
+static uint8_t sound_regs[8];
+
+static void
+ula_set_palette (uint8_t logical, uint8_t physical)
+{
+  if (ula_palette[logical] == physical)
+    return;
+
+  ula_palette[logical] = physical;
+  WRITE_BYTE (ULA_PALETTE, (logical << 4) | (physical ^ 7));
+}
+
+static void
+crtc_write (uint8_t reg, uint8_t val)
+{
+  crtc_regs[reg] = val;
+  WRITE_BYTE (CRTC_ADDRESS, reg);
+  WRITE_BYTE (CRTC_DATA, val);
+}
+
+/* Write a byte to the SN76489 through the system VIA.  This goes through
+   snd_write in swram.S, the same path as the sound sequencer, which holds
+   interrupts off for the write (and puts them back as they were).  */
+
+#define SND_ARG 0xaf
+
+extern void snd_write (void);
+
+static void
+sound_chip_write (uint8_t byte)
+{
+  WRITE_BYTE (SND_ARG, byte);
+  snd_write ();
+
+  /* Latch bytes carry the register number in bits 4-6.  */
+  if (byte & 0x80)
+    sound_regs[(byte >> 4) & 7] = byte & 15;
+}
+
 static void
 setmode (uint8_t mode)
 {
@@ -181,12 +319,9 @@ setmode (uint8_t mode)
 }
 
 static void
-setpalette (uint8_t physical, uint8_t logical)
+setpalette (uint8_t logical, uint8_t physical)
 {
-  static uint8_t params[5] = {0, 0, 0, 0, 0};
-  params[0] = physical;
-  params[1] = logical;
-  osword (0xc, &params[0]);
+  ula_set_palette (logical, physical);
 }
 
 static void
@@ -233,13 +368,7 @@ gfx_draw (unsigned x, unsigned y)
 static void
 vdu_var (uint8_t reg, uint8_t val)
 {
-  uint8_t n;
-  oswrch(23);
-  oswrch(0);
-  oswrch(reg);
-  oswrch(val);
-  for (n = 0; n < 6; n++)
-    oswrch (0);
+  crtc_write (reg, val);
 }
 
 static void
@@ -251,9 +380,60 @@ screen_start (void *addr)
   vdu_var (12, iaddr >> 8);
 }
 
+#ifdef DOUBLE_BUFFER
+/* The screen exists twice, in main and shadow RAM.  The playfield is drawn
+   into whichever isn't being displayed, then the two are flipped.  Anything
+   else is drawn into both.  Our variables and stack must live below &3000
+   for this to work (see rom-shadow.cfg).  */
+
+#define ACCCON 0xfe34
+#define ACCCON_D 1
+#define ACCCON_X 4
+
+static uint8_t front;
 
 static void
-render_tile (uint8_t *addr, uint8_t tileno)
+cpu_buffer (uint8_t buf)
+{
+  uint8_t acccon = READ_BYTE (ACCCON) & ~ACCCON_X;
+  if (buf)
+    acccon |= ACCCON_X;
+  WRITE_BYTE (ACCCON, acccon);
+}
+
+static void
+page_flip (void)
+{
+  uint8_t acccon;
+
+  /* Wait for vsync.  */
+  osbyte (19, 0, 0);
+
+  front ^= 1;
+  acccon = READ_BYTE (ACCCON) & ~ACCCON_D;
+  if (front)
+    acccon |= ACCCON_D;
+  WRITE_BYTE (ACCCON, acccon);
+}
+
+#define ON_BOTH_BUFFERS(...)		\
+  do					\
+    {					\
+      uint8_t buf_;			\
+      for (buf_ = 0; buf_ < 2; buf_++)	\
+        {				\
+          cpu_buffer (buf_);		\
+          __VA_ARGS__;			\
+        }				\
+      cpu_buffer (front);		\
+    }					\
+  while (0)
+#else
+#define ON_BOTH_BUFFERS(...) __VA_ARGS__
+#endif
+
+static void
+render_rle_tile (uint8_t *addr, uint8_t tileno)
 {
   uint8_t x, y, row;
   uint8_t *tileptr = tiles[tileno];
@@ -311,6 +491,34 @@ render_tile (uint8_t *addr, uint8_t tileno)
     }
 }
 
+/* Zero-page locations shared with the routines in swram.S.  */
+#define SPRITE_PTR 0xa8
+#define CACHE_PTR 0xaa
+#define SPRITE_TILE 0xae
+
+#ifdef COMPILED_TILES
+/* These live in the sprite bank, in sideways RAM.  sprite_call (in swram.S)
+   pages it in and jumps through the table at its start.  */
+extern void sprite_call (void);
+#endif
+
+static void
+render_tile (uint8_t *addr, uint8_t tileno)
+{
+#ifdef COMPILED_TILES
+  if (tiles[SPRITE_MAP][tileno])
+    {
+      WRITE_BYTE (SPRITE_PTR, (unsigned) addr & 255);
+      WRITE_BYTE (SPRITE_PTR + 1, (unsigned) addr >> 8);
+      WRITE_BYTE (SPRITE_TILE, tileno);
+      sprite_call ();
+      return;
+    }
+#endif
+
+  render_rle_tile (addr, tileno);
+}
+
 static void
 render_solid_tile (uint8_t *addr, uint8_t tileno)
 {
@@ -332,82 +540,49 @@ render_solid_tile (uint8_t *addr, uint8_t tileno)
     }
 }
 
-static uint8_t rng (void)
-{
-  uint8_t rnum;
-  
-  do {
-    rnum = rand() & 7;
-  } while (rnum > 5);
-  
-  return rnum;
-}
-
-static uint8_t playfield[9][9];
-
-#if 1
-static uint8_t background[9][9] =
-  {
-    { 0, 0, 0, 0, 0, 0, 0, 0, 0 },
-    { 0, 0, 0, 0, 0, 0, 0, 0, 0 },
-    { 0, 0, 0, 0, 0, 0, 0, 0, 0 },
-    { 0, 0, 0, 0, 1, 0, 0, 0, 0 },
-    { 0, 0, 0, 1, 1, 1, 0, 0, 0 },
-    { 0, 0, 0, 0, 1, 0, 0, 0, 0 },
-    { 0, 0, 0, 0, 0, 0, 0, 0, 0 },
-    { 0, 0, 0, 0, 0, 0, 0, 0, 0 },
-    { 0, 0, 0, 0, 0, 0, 0, 0, 0 }
-  };
-#else
-
-#define S SWIRL_MASK
-#define C CAGE_MASK
-
-#if 0
-
-static uint8_t background[9][9] =
-  {
-    { 0, 0, 0, 0, 0, 0, 0, 0, 0 },
-    { 0, 0, 0, 0, 0, 0, 0, 0, 0 },
-    { 0, 0, 0, 0, 0, 0, 0, 0, 0 },
-    { 0, 0, 0, 0, 0, 0, 0, 0, 0 },
-    { 0, 0, 0, S, S, S, 0, 0, 0 },
-    { 0, 0, 0, 0, 0, 0, 0, 0, 0 },
-    { C, 0, 0, 0, 0, 0, 0, 0, C },
-    { 1|C, 0, 0, 0, 0, 0, 0, 0, 1|C },
-    { 2|C, 2|C, 0, 0, 0, 0, 0, 2|C, 2|C }
-  };
+/* These are all packed BCD, least significant byte first (see bcd.S), so
+   the status line can be drawn without dividing.  */
+static uint8_t thescore[5];
+static uint8_t movesleft[2];
+static uint8_t jellies;
 
-#else
+#define BCD_PTR 0xa8
+#define BCD_LEN 0xaa
+#define BCD_ARG 0xab
 
-static uint8_t background[9][9] =
-  {
-    { 0, 0, 0, 0, 0, 0, 0, 0, 0 },
-    { 0, 0, 0, 0, 0, 0, 0, 0, 0 },
-    { 0, 0, 0, 0, 0, 0, 0, 0, 0 },
-    { 0, 0, 0, 0, 0, 0, 0, 0, 0 },
-    { S, S, S, S, S, S, S, S, S },
-    { C, C, C, C, C, C, C, C, C },
-    { 0, 0, 0, 0, 0, 0, 0, 0, 0 },
-    { 1, 1, 1, 1, 1, 1, 1, 1, 1 },
-    { 1, 1, 1, 1, 1, 1, 1, 1, 1 }
-  };
+extern void bcd_add (void);
+extern void bcd_sub (void);
+extern void bcd_from_binary (void);
 
-#endif
+static void
+bcd_args (uint8_t *number, uint8_t bytes, uint8_t arg)
+{
+  WRITE_BYTE (BCD_PTR, (unsigned) number & 255);
+  WRITE_BYTE (BCD_PTR + 1, (unsigned) number >> 8);
+  WRITE_BYTE (BCD_LEN, bytes);
+  WRITE_BYTE (BCD_ARG, arg);
+}
 
-#undef C
-#undef H
+/* Add to the score.  The argument is BCD too, e.g. 0x20 for 20 points.  */
 
-#endif
+void
+add_score (uint8_t points)
+{
+  bcd_args (thescore, sizeof (thescore), points);
+  bcd_add ();
+}
 
-static unsigned long thescore = 0;
-static unsigned movesleft = 100;
-static uint8_t jellies;
+static uint8_t
+bcd_to_binary (uint8_t bcd)
+{
+  uint8_t tens = bcd >> 4;
+  return (tens << 3) + (tens << 1) + (bcd & 15);
+}
 
 static void
 hline (uint8_t sx, uint8_t ex, uint8_t y, uint8_t andcol, uint8_t orcol)
 {
-  uint8_t *row = &screenbase[(y >> 3) * ROWLENGTH + (y & 7)];
+  uint8_t *row = SCANLINE_ADDR (y);
   uint8_t x, len = ex - sx;
 
   if (sx & 1)
@@ -419,8 +594,14 @@ hline (uint8_t sx, uint8_t ex, uint8_t y, uint8_t andcol, uint8_t orcol)
     }
 
   if (len > 2)
-    for (x = sx; x < ex - 1; x += 2)
-      row[x << 2] = (row[x << 2] & andcol) | orcol;
+    {
+      uint8_t *p = &row[sx << 2];
+      for (x = sx; x < ex - 1; x += 2)
+        {
+          *p = (*p & andcol) | orcol;
+          p += 8;
+        }
+    }
 
   if (ex & 1)
     row[(ex & ~1) << 2] = (row[(ex & ~1) << 2] & (andcol | 0x55))
@@ -430,7 +611,7 @@ hline (uint8_t sx, uint8_t ex, uint8_t y, uint8_t andcol, uint8_t orcol)
 static void
 vline (uint8_t x, uint8_t sy, uint8_t ey, uint8_t andcol, uint8_t orcol)
 {
-  uint8_t *row = &screenbase[(sy >> 3) * ROWLENGTH + ((x & ~1) << 2)];
+  uint8_t *row = charrow[sy >> 3] + ((x & ~1) << 2);
   uint8_t y;
 
   if (x & 1)
@@ -454,12 +635,13 @@ vline (uint8_t x, uint8_t sy, uint8_t ey, uint8_t andcol, uint8_t orcol)
 
 static void box (uint8_t cursx, uint8_t cursy, uint8_t andcol, uint8_t orcol)
 {
-  unsigned left = cursx * 16;
-  unsigned bottom = cursy * 24;
-  hline (left, left + 15, bottom, andcol, orcol);
-  hline (left, left + 15, bottom + 23, andcol, orcol);
-  vline (left, bottom, bottom + 23, andcol, orcol);
-  vline (left + 15, bottom, bottom + 23, andcol, orcol);
+  uint8_t left = cursx << 4;
+  uint8_t bottom = (cursy << 4) + (cursy << 3);
+  ON_BOTH_BUFFERS (
+    hline (left, left + 15, bottom, andcol, orcol);
+    hline (left, left + 15, bottom + 23, andcol, orcol);
+    vline (left, bottom, bottom + 23, andcol, orcol);
+    vline (left + 15, bottom, bottom + 23, andcol, orcol));
   /*unsigned left = cursx * 128;
   unsigned bottom = 928 - cursy * 96;
   gfx_move (left, bottom);
@@ -469,249 +651,279 @@ static void box (uint8_t cursx, uint8_t cursy, uint8_t andcol, uint8_t orcol)
   gfx_draw (left, bottom);*/
 }
 
-static void
-redraw_tile (uint8_t x, uint8_t y)
-{
-  uint8_t *tileat = &screenbase[y * ROWLENGTH * 3 + x * 8 * 8];
-  render_solid_tile (tileat, BG_TILES + (background[y][x] & BG_MASK));
-  if ((playfield[y][x] & 127) != EMPTY_TILE)
-    render_tile (tileat, playfield[y][x] & 127);
-  if (background[y][x] & CAGE_MASK)
-    render_tile (tileat, CAGE_TILE);
-}
+/* What was last drawn in each cell, so flush_dirty can skip cells which
+   haven't really changed.  */
+static uint8_t shown_fg[9][9], shown_bg[9][9];
 
-static void
-render_tile_xy (uint8_t x, uint8_t y, uint8_t tileno)
-{
-  uint8_t *tileat = &screenbase[y * ROWLENGTH * 3 + x * 8 * 8];
-  render_tile (tileat, tileno);
-}
+/* Cells which need redrawing, one bit per column.  */
+static uint16_t dirty[9];
 
-static uint8_t
-candy_match (uint8_t lhs, uint8_t rhs)
-{
-  lhs &= 127;
-  rhs &= 127;
+#ifdef TILE_CACHE
+/* Each slot holds a whole cell (background, candy and cage) as it appears on
+   screen, keyed by those three things.  Slots are evicted least recently
+   used first.  */
 
-  if (lhs < FIRST_NONCOLOUR && rhs < FIRST_NONCOLOUR)
-    return (lhs % 6) == (rhs % 6);
+#define CACHE_BANK 6
+#define CACHE_SLOTS 85
 
-  return 0;
-}
+/* The MOS's table of ROM types, one byte per bank.  Zero means empty.  */
+#define ROM_TYPE_TABLE 0x2a1
+
+#define CACHE_KEY(FG, BG) \
+  (((FG) & 31) | (((BG) & 3) << 5) | (((BG) & CAGE_MASK) ? 0x80 : 0))
+
+static uint8_t cache_slot[256];
+static uint8_t slot_key[CACHE_SLOTS];
+static uint16_t slot_used[CACHE_SLOTS];
+static uint16_t cache_clock;
+
+/* Not static, so they can be found in render.map.  */
+uint16_t cache_hits, cache_misses;
+
+#ifdef ROM
+extern void cache_fetch (void);
+extern void cache_store (void);
+#endif
 
 static void
-explode_a_colour (uint8_t c)
+cache_init (void)
 {
-  uint8_t x, y;
-  for (y = 0; y < 9; y++)
-    for (x = 0; x < 9; x++)
-      {
-        if (candy_match (playfield[y][x], c))
-          playfield[y][x] |= 128;
-      }
+  /* Whatever was in the bank before, the MOS mustn't send it service
+     calls now.  */
+  WRITE_BYTE (ROM_TYPE_TABLE + CACHE_BANK, 0);
+
+  memset (cache_slot, 255, sizeof (cache_slot));
+  memset (slot_used, 0, sizeof (slot_used));
+  cache_clock = 0;
 }
 
-static void trigger (uint8_t, uint8_t, uint8_t);
+/* Advance the clock for a slot being used.  Start again rather than let it
+   wrap, which would make the newest slot look the oldest.  */
 
-static uint8_t
-stripes_match (uint8_t oldx, uint8_t oldy, uint8_t newx, uint8_t newy, uint8_t fix_move)
+static uint16_t
+cache_tick (void)
 {
-  uint8_t lhs = playfield[oldy][oldx], rhs = playfield[newy][newx];
-  uint8_t i;
-
-  if (lhs >= V_TILES && lhs < FIRST_NONCOLOUR
-      && rhs >= V_TILES && rhs < FIRST_NONCOLOUR)
+  if (++cache_clock == 0)
     {
-      if (fix_move)
-        for (i = 0; i < 9; i++)
-          {
-            trigger (i, oldy, lhs);
-            trigger (oldx, i, lhs);
-            trigger (i, newy, rhs);
-            trigger (newx, i, rhs);
-          }
-      thescore += 3;
-      return 1;
+      cache_init ();
+      cache_clock = 1;
     }
 
-  return 0;
+  return cache_clock;
 }
 
-static uint8_t
-colourbomb_match (uint8_t *lhsp, uint8_t *rhsp, uint8_t fix_move)
+/* A slot holds a cell if that cell's key still maps to it.  */
+#define SLOT_FULL(SLOT) (cache_slot[slot_key[SLOT]] == (SLOT))
+
+static void
+cache_copy (uint8_t *addr, uint8_t slot, uint8_t to_screen)
 {
-  uint8_t lhs = *lhsp, rhs = *rhsp;
+  uint8_t *slotp = (uint8_t *) 0x8000 + ((unsigned) slot << 7)
+                   + ((unsigned) slot << 6);
+#ifdef ROM
+  /* We're running from sideways RAM ourselves, so this has to be done from
+     main RAM.  */
+  WRITE_BYTE (SPRITE_PTR, (unsigned) addr & 255);
+  WRITE_BYTE (SPRITE_PTR + 1, (unsigned) addr >> 8);
+  WRITE_BYTE (CACHE_PTR, (unsigned) slotp & 255);
+  WRITE_BYTE (CACHE_PTR + 1, (unsigned) slotp >> 8);
+  if (to_screen)
+    cache_fetch ();
+  else
+    cache_store ();
+#else
+  uint8_t row, i;
 
-  if (lhs == COLOURBOMB_TILE)
+  select_sram (CACHE_BANK);
+  for (row = 0; row < 3; row++)
     {
-      if (fix_move && rhs < FIRST_NONCOLOUR)
-        {
-          *lhsp |= 128;
-          explode_a_colour (rhs);
-        }
-
-      thescore += 3;
-
-      return 1;
+      if (to_screen)
+        memcpy (addr, slotp, 64);
+      else
+        for (i = 0; i < 64; i++)
+          slotp[i] = addr[i] & 0x3f;
+      addr += ROWLENGTH;
+      slotp += 64;
     }
-  else if (rhs == COLOURBOMB_TILE)
-    {
-      if (fix_move && lhs < FIRST_NONCOLOUR)
-        {
-          *rhsp |= 128;
-          explode_a_colour (lhs);
-        }
+  deselect_sram ();
+#endif
+}
 
-      thescore += 3;
+static uint8_t
+cache_draw (uint8_t *addr, uint8_t key)
+{
+  uint8_t slot = cache_slot[key];
 
-      return 1;
+  if (slot == 255)
+    {
+      cache_misses++;
+      return 0;
     }
 
-  return 0;
-}
+  cache_hits++;
+  slot_used[slot] = cache_tick ();
+  cache_copy (addr, slot, 1);
 
-// Terrifyingly recursive!
+  return 1;
+}
 
 static void
-trigger (uint8_t x, uint8_t y, uint8_t eq)
+cache_insert (uint8_t *addr, uint8_t key)
 {
-  uint8_t trigger_char = playfield[y][x] & 127, i, j;
-
-  playfield[y][x] |= 128;
-  thescore++;
+  uint8_t slot, victim = 0;
+  uint16_t now = cache_tick ();
 
-  if (trigger_char == EMPTY_TILE || trigger_char == SWIRL_TILE)
-    return;
+  for (slot = 1; slot < CACHE_SLOTS; slot++)
+    if (slot_used[slot] < slot_used[victim])
+      victim = slot;
 
-  // We're exploding a colourbomb!
-  if (trigger_char == COLOURBOMB_TILE)
-    {
-      explode_a_colour (eq);
-      return;
-    }
+  if (SLOT_FULL (victim))
+    cache_slot[slot_key[victim]] = 255;
 
-  if (trigger_char >= (uint8_t) H_TILES &&
-      trigger_char < (uint8_t) (H_TILES + 6))
-    for (i = 0; i < 9; i++)
-      {
-        if (!(playfield[y][i] & 128))
-          trigger (i, y, eq);
-      }
+  slot_key[victim] = key;
+  slot_used[victim] = now;
+  cache_slot[key] = victim;
+  cache_copy (addr, victim, 0);
+}
+#endif
 
-  if (trigger_char >= (uint8_t) V_TILES &&
-      trigger_char < (uint8_t) (V_TILES + 6))
-    for (i = 0; i < 9; i++)
-      {
-        if (!(playfield[i][x] & 128))
-          trigger (x, i, eq);
-      }
+static void
+redraw_tile (uint8_t x, uint8_t y)
+{
+  uint8_t *tileat = CELL_ADDR (x, y);
+#ifdef TILE_CACHE
+  uint8_t key = CACHE_KEY (playfield[y][x] & 127, background[y][x]);
 
-  if (trigger_char >= (uint8_t) WRAP_TILES
-      && trigger_char < (uint8_t) (WRAP_TILES + 6))
+  if (!cache_draw (tileat, key))
+#endif
     {
-      uint8_t l = x > 0 ? x - 1 : 0;
-      uint8_t t = y > 0 ? y - 1 : 0;
-      uint8_t r = x < 8 ? x + 1 : 8;
-      uint8_t b = y < 8 ? y + 1 : 8;
-      for (i = l; i <= r; i++)
-        for (j = t; j <= b; j++)
-          {
-            if (!(playfield[j][i] & 128))
-              trigger (i, j, eq);
-          }
+      render_solid_tile (tileat, BG_TILES + (background[y][x] & BG_MASK));
+      if ((playfield[y][x] & 127) != EMPTY_TILE)
+        render_tile (tileat, playfield[y][x] & 127);
+      if (background[y][x] & CAGE_MASK)
+        render_tile (tileat, CAGE_TILE);
+#ifdef TILE_CACHE
+      cache_insert (tileat, key);
+#endif
     }
+
+  shown_fg[y][x] = playfield[y][x] & 127;
+  shown_bg[y][x] = background[y][x];
 }
 
-static uint8_t
-horizontal_match (uint8_t x, uint8_t y, uint8_t eq, uint8_t fix_matches)
+void
+mark_dirty (uint8_t x, uint8_t y)
 {
-  uint8_t c;
-  uint8_t right = x, left = x, matching;
-  
-  for (c = x + 1; c < 9; c++)
-    {
-      if (candy_match (playfield[y][c], eq))
-        right = c;
-      else
-        break;
-    }
-
-  for (c = x - 1; c != 255; c--)
-    {
-      if (candy_match (playfield[y][c], eq))
-        left = c;
-      else
-        break;
-    }
+  dirty[y] |= cellbit[x];
+}
 
-  matching = right - left + 1;
+static void
+mark_all_dirty (void)
+{
+  uint8_t y;
+  for (y = 0; y < 9; y++)
+    dirty[y] = 0x1ff;
+}
 
-  if (fix_matches && matching >= 3)
-    {
-      for (x = left; x <= right; x++)
-        trigger (x, y, eq);
-    }
+/* Forget what's on screen, e.g. after clearing it.  */
 
-  return matching;
+static void
+invalidate_shown (void)
+{
+  memset (shown_bg, 255, sizeof (shown_bg));
 }
 
-static uint8_t
-vertical_match (uint8_t x, uint8_t y, uint8_t eq, uint8_t fix_matches)
+#ifdef DOUBLE_BUFFER
+/* Cells changed in the hidden buffer since the last flip.  */
+static uint16_t redrawn[9];
+#endif
+
+void
+flush_dirty (void)
 {
-  uint8_t c;
-  uint8_t bottom = y, top = y, matching;
-  
-  for (c = y + 1; c < 9; c++)
-    {
-      if (candy_match (playfield[c][x], eq))
-        bottom = c;
-      else
-        break;
-    }
+  uint8_t x, y;
+#ifdef DOUBLE_BUFFER
+  uint8_t any_redrawn = 0;
+
+  cpu_buffer (front ^ 1);
+#endif
+
+  PROF_BEGIN (PROF_REDRAW);
 
-  for (c = y - 1; c != 255; c--)
+  for (y = 0; y < 9; y++)
     {
-      if (candy_match (playfield[c][x], eq))
-        top = c;
-      else
-        break;
-    }
+#ifdef DOUBLE_BUFFER
+      if (redrawn[y])
+        any_redrawn = 1;
+#endif
+      if (!dirty[y])
+        continue;
+
+      for (x = 0; x < 9; x++)
+        if ((dirty[y] & cellbit[x])
+            && ((playfield[y][x] & 127) != shown_fg[y][x]
+                || background[y][x] != shown_bg[y][x]))
+          {
+            redraw_tile (x, y);
+#ifdef DOUBLE_BUFFER
+            redrawn[y] |= cellbit[x];
+            any_redrawn = 1;
+#endif
+          }
 
-  matching = bottom - top + 1;
+      dirty[y] = 0;
+    }
 
-  if (fix_matches && matching >= 3)
+#ifdef DOUBLE_BUFFER
+  if (any_redrawn)
     {
-      for (y = top; y <= bottom; y++)
-        trigger (x, y, eq);
+      page_flip ();
+
+      /* Bring the buffer we were just looking at up to date.  */
+      cpu_buffer (front ^ 1);
+      for (y = 0; y < 9; y++)
+        if (redrawn[y])
+          {
+            for (x = 0; x < 9; x++)
+              if (redrawn[y] & cellbit[x])
+                redraw_tile (x, y);
+            redrawn[y] = 0;
+          }
     }
 
-  return matching;
-}
+  cpu_buffer (front);
+#endif
 
-static void
-reset_playfield_marks (void)
-{
-  uint8_t x, y;
-  for (y = 0; y < 9; y++)
-    for (x = 0; x < 9; x++)
-      playfield[y][x] &= ~128;
+  PROF_END (PROF_REDRAW);
 }
 
 static void
-do_swap (uint8_t oldx, uint8_t oldy, uint8_t newx, uint8_t newy)
+render_tile_xy (uint8_t x, uint8_t y, uint8_t tileno)
 {
-  uint8_t oldtile = playfield[oldy][oldx];
-  playfield[oldy][oldx] = playfield[newy][newx];
-  playfield[newy][newx] = oldtile;
+  uint8_t *tileat = CELL_ADDR (x, y);
+  render_tile (tileat, tileno);
 }
 
 static void
 show_swap (uint8_t oldx, uint8_t oldy, uint8_t newx, uint8_t newy)
 {
-  redraw_tile (oldx, oldy);
-  redraw_tile (newx, newy);
+  mark_dirty (oldx, oldy);
+  mark_dirty (newx, newy);
+  flush_dirty ();
 }
 
+/* The sound sequencer, in swram.S.  */
+
+#define SND_RING_SIZE 8
+#define SND_ENV_TICKS 32
+
+extern uint8_t snd_ring[SND_RING_SIZE * 4];
+extern volatile uint8_t snd_head;
+extern uint8_t snd_tail;
+extern int8_t snd_env_pitch[3 * SND_ENV_TICKS];
+extern uint8_t snd_env_atten[3 * SND_ENV_TICKS];
+extern void snd_init (void);
+
 static void sound (int channel, int amplitude, int pitch, int duration);
 
 static void
@@ -722,6 +934,10 @@ show_explosions (void)
   uint8_t num_explosions = 0;
   uint8_t explosion_vol;
 
+#ifdef DOUBLE_BUFFER
+  cpu_buffer (front ^ 1);
+#endif
+
   for (y = 0; y < 9; y++)
     for (x = 0; x < 9; x++)
       {
@@ -729,15 +945,22 @@ show_explosions (void)
           {
             if (!made_jelly_sound && (background[y][x] & BG_MASK) == 1)
               {
-                sound (0x13, 3, 130 - jellies, 10);
+                sound (0x13, 3, 130 - bcd_to_binary (jellies), 10);
                 made_jelly_sound = 1;
               }
 
             render_tile_xy (x, y, EXPLOSION_TILE);
+            shown_fg[y][x] = EXPLOSION_TILE;
             num_explosions++;
           }
       }
 
+#ifdef DOUBLE_BUFFER
+  /* The other buffer catches up when the exploded cells are redrawn.  */
+  page_flip ();
+  cpu_buffer (front);
+#endif
+
   explosion_vol = (unsigned) num_explosions + 6;
   if (explosion_vol > 15)
     explosion_vol = 15;
@@ -746,414 +969,548 @@ show_explosions (void)
   sound (0x11, 2, 200, 15);
 }
 
-static void pause (unsigned long amt)
-{
-  unsigned long wait;
-  for (wait = 0; wait < amt; wait++)
-    __asm__ __volatile__ ("nop");
-}
+/* The frame clock counts vsyncs (50 a second), using the vsync event.  The
+   handler is frame_event in swram.S.  */
 
-static void
-deswirl (uint8_t x, uint8_t y)
-{
-  background[y][x] &= ~SWIRL_MASK;
-  playfield[y][x] = EMPTY_TILE;
-  redraw_tile (x, y);
-  thescore += 10;
-}
+#define EVNTV 0x220
+
+#define EXPLOSION_FRAMES 25
+#define LOGO_FRAMES 50
+
+extern volatile uint16_t frame_count;
+extern uint16_t old_evntv;
+extern void frame_event (void);
 
 static void
-shuffle_explosions (void)
+frame_clock_init (void)
 {
-  uint8_t x, y, y2;
-  uint8_t some_explosions = 0;
-  uint8_t some_movement = 0;
+  __asm__ __volatile__ ("sei");
+  old_evntv = READ_BYTE (EVNTV) | (READ_BYTE (EVNTV + 1) << 8);
+  WRITE_BYTE (EVNTV, (unsigned) &frame_event & 255);
+  WRITE_BYTE (EVNTV + 1, (unsigned) &frame_event >> 8);
+  __asm__ __volatile__ ("cli");
 
-  for (y = 0; y < 9; y++)
-    for (x = 0; x < 9; x++)
-      {
-        if (playfield[y][x] & 128)
-          {
-            playfield[y][x] = EMPTY_TILE;
-
-            if (background[y][x] & CAGE_MASK)
-              {
-                background[y][x] &= ~CAGE_MASK;
-                redraw_tile (x, y);
-                thescore += 20;
-              }
+  /* Enable the vsync event.  */
+  osbyte (14, 4, 0);
+}
 
-            if (x > 0 && (background[y][x - 1] & SWIRL_MASK))
-              deswirl (x - 1, y);
-            if (x < 8 && (background[y][x + 1] & SWIRL_MASK))
-              deswirl (x + 1, y);
-            if (y > 0 && (background[y - 1][x] & SWIRL_MASK))
-              deswirl (x, y - 1);
-            if (y < 8 && (background[y + 1][x] & SWIRL_MASK))
-              deswirl (x, y + 1);
-
-            // Remove jelly (like a boss).
-            if (background[y][x] > 0 && background[y][x] <= 2)
-              {
-                thescore += 10;
-                background[y][x]--;
-              }
-          }
-      }
+static uint16_t
+frames (void)
+{
+  uint16_t now;
 
+  /* The count can change between reading its two bytes.  */
   do
-    {
-      some_explosions = some_movement = 0;
-      for (y = 0; y < 9; y++)
-        {
-          uint8_t use_y = 8 - y;
-          for (x = 0; x < 9; x++)
-            {
-              if (playfield[use_y][x] == EMPTY_TILE)
-                {
-                  if (use_y > 0 && (background[use_y - 1][x] & ~BG_MASK))
-                    playfield[use_y][x] = EMPTY_TILE;
-                  else if (use_y > 0)
-                    {
-                      if (playfield[use_y - 1][x] != EMPTY_TILE)
-                        some_movement = 1;
-                      playfield[use_y][x] = playfield[use_y - 1][x];
-                      playfield[use_y - 1][x] = EMPTY_TILE;
-                    }
-                  else
-                    {
-                      playfield[0][x] = rng ();
-                      some_movement = 1;
-                    }
-
-                  redraw_tile (x, use_y);
+    now = frame_count;
+  while (now != frame_count);
 
-                  some_explosions = 1;
-                }
-            }
-        }
-    }
-  while (some_explosions && some_movement);
+  return now;
 }
 
+#ifdef PROFILE
+/* Section timing, using the User VIA's timer 2 as a free-running counter.
+   It counts down a microsecond (two CPU cycles) at a time, so wraps every
+   65536us, a little over three frames; the frame clock says how many times
+   it has wrapped during a longer section.  Times include any interrupts
+   taken meanwhile, the vsync event's sound sequencer among them.  Sections
+   may nest (a gravity step redraws), but not within themselves.  */
+
+typedef struct
+{
+  unsigned long total;
+  unsigned long max;
+  unsigned long calls;
+  uint16_t start;
+  uint16_t start_frame;
+} prof_section;
+
+static prof_section prof_table[PROF_SECTIONS];
+
 static void
-selected_state (uint8_t selected)
+prof_init (void)
+{
+  /* One-shot mode, which carries on counting past zero, with its
+     interrupt off.  Writing the high byte starts it.  */
+  WRITE_BYTE (USRVIA_IER, 0x20);
+  WRITE_BYTE (USRVIA_ACR, READ_BYTE (USRVIA_ACR) & ~0x20);
+  WRITE_BYTE (USRVIA_T2CL, 255);
+  WRITE_BYTE (USRVIA_T2CH, 255);
+}
+
+static uint16_t
+prof_timer (void)
 {
-  if (selected)
+  uint8_t hi, lo;
+
+  /* The low byte can wrap between reading the two.  */
+  do
     {
-      for (uint8_t c = 0; c < 8; c++)
-        setpalette (c + 8, 8);
-    }
-  else
-    {
-      for (uint8_t c = 0; c < 8; c++)
-        setpalette (c + 8, 7);
+      hi = READ_BYTE (USRVIA_T2CH);
+      lo = READ_BYTE (USRVIA_T2CL);
     }
+  while (hi != READ_BYTE (USRVIA_T2CH));
+
+  return (hi << 8) | lo;
 }
 
 static void
-make_special (uint8_t base, uint8_t *x)
+prof_begin (uint8_t id)
 {
-  uint8_t candy = *x;
-  candy &= 127;
-  if (candy < 6)
-    candy += base;
-  *x = candy;
+  prof_table[id].start_frame = frames ();
+  prof_table[id].start = prof_timer ();
 }
 
-static char
-special_candy (uint8_t *position, uint8_t h_score, uint8_t v_score)
+static void
+prof_end (uint8_t id)
 {
-  if (h_score >= 5 || v_score >= 5)
-    {
-      thescore += 20;
-      *position = COLOURBOMB_TILE;
-    }
-  else if (h_score >= 3 && v_score >= 3)
-    {
-      thescore += 20;
-      make_special (WRAP_TILES, position);
-    }
-  else if (h_score >= 4)
-    {
-      thescore += 10;
-      make_special (H_TILES, position);
-    }
-  else if (v_score >= 4)
-    {
-      thescore += 10;
-      make_special (V_TILES, position);
-    }
-  else
-    return 0;
+  prof_section *sect = &prof_table[id];
+  uint16_t ticks = sect->start - prof_timer ();
+  uint16_t nframes = frames () - sect->start_frame;
+  unsigned long elapsed = ticks;
 
-  return 1;
-}
+  /* The frame count puts the true time within a frame (20000us) either
+     way, so add whichever multiple of 65536 brings it nearest.  */
+  elapsed += (nframes * 20000ul + 32768 - ticks) & 0xffff0000ul;
 
-static uint8_t
-permitted_swap (uint8_t oldx, uint8_t oldy, uint8_t newx, uint8_t newy)
-{
-  uint8_t lhs = playfield[oldy][oldx];
-  uint8_t rhs = playfield[newy][newx];
-
-  /* Swapping a colour with itself isn't a "move".  */
-  if (lhs < FIRST_NONCOLOUR
-      && rhs < FIRST_NONCOLOUR
-      && (lhs % 6) == (rhs % 6))
-    return 0;
-
-  /* Disallow illegal moves.  */
-  if ((rhs >= FIRST_NONCOLOUR
-       || lhs >= FIRST_NONCOLOUR)
-      && lhs != COLOURBOMB_TILE
-      && rhs != COLOURBOMB_TILE
-      && lhs != EMPTY_TILE
-      && rhs != EMPTY_TILE)
-    return 0;
-
-  /* Can't swap with cages or swirls.  */
-  if ((background[oldy][oldx] & ~BG_MASK)
-      || (background[newy][newx] & ~BG_MASK))
-    return 0;
+  sect->total += elapsed;
+  if (elapsed > sect->max)
+    sect->max = elapsed;
+  sect->calls++;
+}
+#endif
 
-  return 1;
+static uint16_t
+frame_deadline (uint8_t nframes)
+{
+  return frames () + nframes;
 }
 
 static uint8_t
-successful_move (uint8_t oldx, uint8_t oldy, uint8_t newx, uint8_t newy)
+deadline_passed (uint16_t deadline)
 {
-  uint8_t selected_tile;
-  uint8_t h_score = 0, v_score = 0, success = 0;
-  uint8_t lhs = playfield[oldy][oldx];
-  uint8_t rhs = playfield[newy][newx];
-
-  if (!permitted_swap (oldx, oldy, newx, newy))
-    return 0;
+  return (int16_t) (frames () - deadline) >= 0;
+}
 
-  do_swap (oldx, oldy, newx, newy);
+static void
+wait_until (uint16_t deadline)
+{
+  TRACE (TRACE_IDLE_START);
+  while (!deadline_passed (deadline))
+    ;
+  TRACE (TRACE_IDLE_END);
+}
 
-  success = stripes_match (oldx, oldy, newx, newy, 1);
+static void
+wait_frames (uint8_t nframes)
+{
+  wait_until (frame_deadline (nframes));
+}
 
-  success |= colourbomb_match (&playfield[newy][newx],
-                               &playfield[oldy][oldx], 1);
+/* A candy has just fallen from (x, y - 1) to (x, y).  If the cell above is
+   up to date on screen and has the same background, copy its pixels down
+   rather than drawing the candy again.  */
 
-  selected_tile = playfield[newy][newx];
-  h_score = horizontal_match (newx, newy, selected_tile, 1);
-  v_score = vertical_match (newx, newy, selected_tile, 1);
+void
+fall_by_copy (uint8_t x, uint8_t y)
+{
+  uint8_t *src, *dst;
+  uint8_t row, i;
 
-  success |= h_score >= 3 || v_score >= 3;
-  if (!special_candy (&playfield[newy][newx], h_score, v_score))
-    thescore += 5;
+  if (background[y][x] != background[y - 1][x]
+      || shown_bg[y - 1][x] != background[y - 1][x]
+      || shown_fg[y - 1][x] != (playfield[y][x] & 127))
+    return;
 
-  selected_tile = playfield[oldy][oldx];
-  h_score = horizontal_match (oldx, oldy, selected_tile, 1);
-  v_score = vertical_match (oldx, oldy, selected_tile, 1);
+  src = CELL_ADDR (x, y - 1);
+  dst = CELL_ADDR (x, y);
 
-  success |= h_score >= 3 || v_score >= 3;
-  if (!special_candy (&playfield[oldy][oldx], h_score, v_score))
-    thescore += 5;
+#ifdef DOUBLE_BUFFER
+  cpu_buffer (front ^ 1);
+#endif
 
-  if (success)
-    return 1;
+  /* Leave the cursor behind, as redrawing would.  */
+  for (row = 0; row < 3; row++)
+    {
+      for (i = 0; i < 64; i++)
+        dst[i] = src[i] & 0x3f;
+      src += ROWLENGTH;
+      dst += ROWLENGTH;
+    }
 
-  /* Undo the move.  */
-  do_swap (oldx, oldy, newx, newy);
+#ifdef DOUBLE_BUFFER
+  redrawn[y] |= cellbit[x];
+  cpu_buffer (front);
+#endif
 
-  return 0;
+  shown_fg[y][x] = shown_fg[y - 1][x];
+  shown_bg[y][x] = background[y][x];
 }
 
-static uint8_t
-move_is_possible (uint8_t oldx, uint8_t oldy, uint8_t newx, uint8_t newy)
-{
-  uint8_t success = 0;
-  
-  if (!permitted_swap (oldx, oldy, newx, newy))
-    return 0;
-  
-  if (stripes_match (oldx, oldy, newx, newy, 0))
-    return 1;
-
-  if (colourbomb_match (&playfield[newy][newx], &playfield[oldy][oldx], 0))
-    return 1;
-  
-  do_swap (oldx, oldy, newx, newy);
-  if (horizontal_match (oldx, oldy, playfield[oldy][oldx], 0) >= 3
-      || vertical_match (oldx, oldy, playfield[oldy][oldx], 0) >= 3
-      || horizontal_match (newx, newy, playfield[newy][newx], 0) >= 3
-      || vertical_match (newx, newy, playfield[newy][newx], 0) >= 3)
-    success = 1;
-  do_swap (oldx, oldy, newx, newy);
-  return success;
+static void
+selected_state (uint8_t selected)
+{
+  if (selected)
+    {
+      for (uint8_t c = 0; c < 8; c++)
+        setpalette (c + 8, 8);
+    }
+  else
+    {
+      for (uint8_t c = 0; c < 8; c++)
+        setpalette (c + 8, 7);
+    }
 }
 
-static void big_text (uint8_t *, char *, uint8_t, uint8_t);
+/* Centiseconds to wait for a key before showing a hint.  */
+#define HINT_DELAY 500
 
-static uint8_t
-reshuffle (void)
+/* Wait up to CENTISECS for a key.  Returns -2 if none was pressed.  */
+
+static int
+inkey (unsigned centisecs)
 {
-  uint8_t i, j;
-  uint8_t *cp = &playfield[0][0];
+  unsigned char dma, dmx, dmy;
+  __asm__ __volatile__ ("jsr $fff4" : "=Aq" (dma), "=xq" (dmx), "=yq" (dmy)
+				    : "Aq" (129), "xq" (centisecs & 255),
+				      "yq" (centisecs >> 8));
 
-  selected_state (0);
-  big_text (&screenbase[10*ROWLENGTH+CENTRE (9)], "Reshuffle", 0xff, 0xc0);
+  if (dmy == 0)
+    return dmx;
 
-  for (i = 0; i < 81; i++)
+  /* Escape.  */
+  if (dmy == 27)
     {
-      if (cp[i] < FIRST_NONCOLOUR)
-        {
-          uint8_t range = 81 - (i + 1), replacement, tmp, any_to_swap = 0;
-          
-          for (j = i + 1; i < 81; j++)
-            if (cp[j] >= FIRST_NONCOLOUR)
-              {
-                any_to_swap = 1;
-                break;
-              }
-          
-          if (any_to_swap)
-            {
-              do
-                {
-                  replacement = i + 1 + rand () % range;
-                }
-              while (cp[replacement] >= FIRST_NONCOLOUR);
-              tmp = cp[i];
-              cp[i] = cp[replacement];
-              cp[replacement] = tmp;
-            }
-          redraw_tile (i % 9, i / 9);
-        }
+      osbyte (126, 0, 0);
+      return -1;
     }
 
-  big_text (&screenbase[10*ROWLENGTH+CENTRE (9)], "Reshuffle", 0x3f, 0x0);
+  return -2;
 }
 
-static uint8_t
-reshuffle_needed (void)
+/* Read a key, outlining the best move if the player takes too long.  */
+
+static int
+read_key (uint8_t cursx, uint8_t cursy)
 {
-  uint8_t x, y;
+  uint8_t hintx, hinty, down;
+  int key = inkey (HINT_DELAY);
 
-  for (x = 0; x < 8; x++)
-    for (y = 0; y < 8; y++)
-      {
-        if (move_is_possible (x, y, x + 1, y))
-          return 0;
+  if (key != -2)
+    return key;
 
-        if (move_is_possible (x, y, x, y + 1))
-          return 0;
-      }
+  if (!best_move (&hintx, &hinty, &down))
+    return osrdch ();
 
-  return 1;
+  box (hintx, hinty, 0xff, 0xc0);
+  box (hintx + !down, hinty + down, 0xff, 0xc0);
+
+  key = osrdch ();
+
+  box (hintx, hinty, 0x3f, 0x00);
+  box (hintx + !down, hinty + down, 0x3f, 0x00);
+  box (cursx, cursy, 0xff, 0xc0);
+
+  return key;
 }
 
-static uint8_t
-retrigger (void)
+/* Big text is at most BIG_TEXT_MAX characters, the width of the screen:
+   big_text drops anything past that.  Banner strings go through
+   BANNER (STR), which is just STR but fails to compile ("size of array
+   is negative") if the string constant is too long.  */
+
+#define BIG_TEXT_MAX 9
+#define BANNER(STR) \
+  (sizeof (char[BIG_TEXT_MAX + 1 - (int) sizeof (STR)]) ? (STR) : (STR))
+
+static void big_text (uint8_t *, char *, uint8_t, uint8_t);
+
+/* Shuffle the candies when there are no moves left, with a banner up
+   meanwhile.  */
+
+static void
+reshuffle (void)
 {
-  uint8_t x, y;
-  uint8_t success = 0;
-  
-  for (y = 0; y < 9; y++)
-    for (x = 0; x < 9; x++)
-      {
-        if (horizontal_match (x, y, playfield[y][x], 1) >= 3)
-          success = 1;
-        if (vertical_match (x, y, playfield[y][x], 1) >= 3)
-          success = 1;
-      }
+  selected_state (0);
+  big_text (CHARROW (10) + CENTRE (9), BANNER ("Reshuffle"), 0xff, 0xc0);
+
+  shuffle_board ();
 
-  return success;
+  mark_all_dirty ();
+  flush_dirty ();
+
+  big_text (CHARROW (10) + CENTRE (9), BANNER ("Reshuffle"), 0x3f, 0x0);
 }
 
 static void
 do_explosions (void)
 {
+  uint16_t deadline;
+
+  TRACE (TRACE_CASCADE_START);
   show_explosions ();
-  pause (20000);
+  deadline = frame_deadline (EXPLOSION_FRAMES);
+  clear_explosions ();
+  wait_until (deadline);
+  PROF_BEGIN (PROF_GRAVITY);
   shuffle_explosions ();
+  PROF_END (PROF_GRAVITY);
   reset_playfield_marks ();
+  TRACE (TRACE_CASCADE_END);
 }
 
+/* The digits currently on the status line (255 if unknown), so only those
+   which change get drawn.  */
+static uint8_t hud_digits[14];
+
+#define HUD_MOVES 0
+#define HUD_JELLIES 3
+#define HUD_SCORE 5
+
 static void
-write_number (uint8_t *at, unsigned long number, uint8_t digits)
+write_number (uint8_t *at, uint8_t *number, uint8_t digits, uint8_t *shown)
 {
-  unsigned long maximum = 1;
   uint8_t i;
-  
-  for (i = 1; i < digits; i++)
-    maximum *= 10;
 
-  for (i = 0; i < digits; i++)
+  for (i = digits; i-- > 0; )
     {
-      uint8_t *digit = tiles[DIGITS_TEXT];
-      digit += ((number / maximum) % 10) * 16;
-      memcpy (at, digit, 16);
+      uint8_t byte = number[i >> 1];
+      uint8_t digit = (i & 1) ? byte >> 4 : byte & 15;
+
+      if (digit != *shown)
+        {
+          uint8_t *glyph = tiles[DIGITS_TEXT] + (digit << 4);
+          ON_BOTH_BUFFERS (memcpy (at, glyph, 16));
+          *shown = digit;
+        }
+
       at += 16;
-      maximum /= 10;
+      shown++;
     }
 }
 
+/* Font data for big_text, so OSWORD 10 is only called once per character.
+   Slots are reused round-robin.  */
+
+#define GLYPH_SLOTS 32
+
+static uint8_t glyph_char[GLYPH_SLOTS];
+static uint8_t glyph_bits[GLYPH_SLOTS][8];
+static uint8_t glyph_next;
+
+static uint8_t *
+glyph (char thechar)
+{
+  /* Not static: in the shadow build, statics are in our own bank, which
+     the OS needn't have paged in while it fills this.  */
+  uint8_t exploded[9];
+  uint8_t i;
+
+  for (i = 0; i < GLYPH_SLOTS; i++)
+    if (glyph_char[i] == thechar)
+      return glyph_bits[i];
+
+  exploded[0] = thechar;
+  osword (10, exploded);
+
+  i = glyph_next;
+  glyph_next = (glyph_next + 1) & (GLYPH_SLOTS - 1);
+  glyph_char[i] = thechar;
+  memcpy (glyph_bits[i], &exploded[1], 8);
+
+  return glyph_bits[i];
+}
+
+/* Each font pixel is a byte column of a character row, and a whole line of
+   big text is contiguous in memory.  So every horizontal run of set pixels
+   is one contiguous span of screen bytes.  */
+
 static void
-big_text (uint8_t *chartop, char *str, uint8_t andval, uint8_t orval)
+big_text_span (uint8_t *at, uint8_t pixels, uint8_t andval, uint8_t orval)
 {
-  static uint8_t exploded[9] = { 1 };
-  uint8_t x, y, c;
+  while (pixels--)
+    {
+      at[0] = (at[0] & andval) | orval;
+      at[1] = (at[1] & andval) | orval;
+      at[2] = (at[2] & andval) | orval;
+      at[3] = (at[3] & andval) | orval;
+      at[4] = (at[4] & andval) | orval;
+      at[5] = (at[5] & andval) | orval;
+      at[6] = (at[6] & andval) | orval;
+      at[7] = (at[7] & andval) | orval;
+      at += 8;
+    }
+}
+
+static void
+big_text_1 (uint8_t *chartop, char *str, uint8_t andval, uint8_t orval)
+{
+  uint8_t *glyphs[BIG_TEXT_MAX];
+  uint8_t len, x, y, c;
 
-  while (*str)
+  for (len = 0; str[len] && len < BIG_TEXT_MAX; len++)
+    glyphs[len] = glyph (str[len]);
+
+  for (y = 0; y < 8; y++)
     {
-      char thechar = *str++;
-      uint8_t *charscan = chartop;
-      exploded[0] = thechar;
-      osword (10, exploded);
-      for (y = 0; y < 8; y++)
+      uint8_t *screenrow = chartop;
+      uint8_t *runstart = 0;
+      uint8_t runlength = 0;
+
+      for (c = 0; c < len; c++)
         {
-          uint8_t row = exploded[y + 1];
-          uint8_t *screenrow = charscan;
+          uint8_t row = glyphs[c][y];
+
           for (x = 0; x < 8; x++)
             {
               if (row & 0x80)
                 {
-                  for (c = 0; c < 8; c++)
-                    screenrow[c] = (screenrow[c] & andval) | orval;
+                  if (!runlength)
+                    runstart = screenrow;
+                  runlength++;
+                }
+              else if (runlength)
+                {
+                  big_text_span (runstart, runlength, andval, orval);
+                  runlength = 0;
                 }
               screenrow += 8;
               row <<= 1;
             }
-          charscan += ROWLENGTH;
         }
-      chartop += 8 * 8;
+
+      if (runlength)
+        big_text_span (runstart, runlength, andval, orval);
+
+      chartop += ROWLENGTH;
+    }
+}
+
+static void
+big_text (uint8_t *chartop, char *str, uint8_t andval, uint8_t orval)
+{
+  ON_BOTH_BUFFERS (big_text_1 (chartop, str, andval, orval));
+}
+
+#ifdef PROFILE
+/* The profile overlay, which P steps through the sections with in place of
+   the status line.  Each shows the section number, the calls, the longest
+   and average time, and the total time (in microseconds, from prof_end).  */
+
+/* Which section is shown, from 1, or 0 for the status line.  */
+static uint8_t prof_shown;
+static uint8_t prof_digits[29];
+
+/* Double dabble, since bcd_from_binary only takes a byte.  */
+
+static void
+prof_to_bcd (unsigned long n, uint8_t *bcd)
+{
+  uint8_t i, j;
+
+  memset (bcd, 0, 5);
+
+  for (i = 0; i < 32; i++)
+    {
+      uint8_t carry = (n & 0x80000000ul) != 0;
+
+      n <<= 1;
+
+      for (j = 0; j < 5; j++)
+        {
+          uint8_t lo = (bcd[j] & 15) * 2 + carry;
+          uint8_t hi = (bcd[j] >> 4) * 2;
+
+          if (lo > 9)
+            {
+              lo -= 10;
+              hi++;
+            }
+          carry = hi > 9;
+          if (carry)
+            hi -= 10;
+          bcd[j] = (hi << 4) | lo;
+        }
     }
 }
 
+static void
+prof_draw (void)
+{
+  prof_section *sect = &prof_table[prof_shown - 1];
+  uint8_t bcd[5];
+
+  bcd[0] = prof_shown;
+  write_number (STATUS_ROW + 2 * 8, bcd, 1, &prof_digits[0]);
+  prof_to_bcd (sect->calls, bcd);
+  write_number (STATUS_ROW + 6 * 8, bcd, 6, &prof_digits[1]);
+  prof_to_bcd (sect->max, bcd);
+  write_number (STATUS_ROW + 20 * 8, bcd, 6, &prof_digits[7]);
+  prof_to_bcd (sect->calls ? sect->total / sect->calls : 0, bcd);
+  write_number (STATUS_ROW + 34 * 8, bcd, 6, &prof_digits[13]);
+  prof_to_bcd (sect->total, bcd);
+  write_number (STATUS_ROW + 48 * 8, bcd, 10, &prof_digits[19]);
+}
+#endif
+
 static void
 refresh_status (void)
 {
-  write_number (&screenbase[ROWLENGTH * 27 + 14 * 8], movesleft, 3);
-  write_number (&screenbase[ROWLENGTH * 27 + 32 * 8], jellies, 2);
-  write_number (&screenbase[ROWLENGTH * 27 + 51 * 8], thescore, 9);
+#ifdef PROFILE
+  if (prof_shown)
+    {
+      prof_draw ();
+      return;
+    }
+#endif
+
+  PROF_BEGIN (PROF_HUD);
+  write_number (STATUS_ROW + 14 * 8, movesleft, 3, &hud_digits[HUD_MOVES]);
+  write_number (STATUS_ROW + 32 * 8, &jellies, 2, &hud_digits[HUD_JELLIES]);
+  write_number (STATUS_ROW + 51 * 8, thescore, 9, &hud_digits[HUD_SCORE]);
+  PROF_END (PROF_HUD);
 }
 
+#ifdef PROFILE
+static void
+prof_next (void)
+{
+  prof_shown = (prof_shown + 1) % (PROF_SECTIONS + 1);
+  memset (prof_digits, 255, sizeof (prof_digits));
+
+  ON_BOTH_BUFFERS (memset (STATUS_ROW, 0x30, ROWLENGTH));
+
+  /* Put the labels back as play_level drew them.  */
+  if (!prof_shown)
+    {
+      ON_BOTH_BUFFERS (
+        memcpy (STATUS_ROW + 2 * 8, tiles[MOVES_TEXT], 11 * 8);
+        memcpy (STATUS_ROW + 23 * 8, tiles[JELLY_TEXT], 8 * 8);
+        memcpy (STATUS_ROW + 39 * 8, tiles[SCORE_TEXT], 10 * 8));
+      memset (hud_digits, 255, sizeof (hud_digits));
+    }
+
+  refresh_status ();
+}
+#endif
+
 static void
 count_jelly (void)
 {
-  uint8_t cnt = 0;
-  uint8_t x, y;
-  
-  for (y = 0; y < 9; y++)
-    for (x = 0; x < 9; x++)
-      {
-        uint8_t bg_tile = background[y][x] & BG_MASK;
-        if (bg_tile == 1 || bg_tile == 2)
-          cnt++;
-      }
+  static uint8_t jelly_bcd[2];
 
-  jellies = cnt;
+  bcd_args (jelly_bcd, sizeof (jelly_bcd), jelly_left ());
+  bcd_from_binary ();
+  jellies = jelly_bcd[0];
 }
 
+/* Each word is a line of big text, so no more than BIG_TEXT_MAX
+   characters.  */
+
 static char *magic_words[] =
   {
-    "Sugar", "Smash",
-    "Fruity", "Yumyums"
-  };    
+    BANNER ("Sugar"), BANNER ("Smash"),
+    BANNER ("Fruity"), BANNER ("Yumyums")
+  };
 
 static void
 write_exciting_logo (uint8_t wordno)
@@ -1162,22 +1519,73 @@ write_exciting_logo (uint8_t wordno)
   char *word2 = magic_words[wordno + 1];
   uint8_t len1 = strlen (word1), len2 = strlen (word2);
   selected_state (1);
-  big_text (&screenbase[5 * ROWLENGTH + CENTRE (len1)], word1, 0xff, 0xc0);
-  big_text (&screenbase[15 * ROWLENGTH + CENTRE (len2)], word2, 0xff, 0xc0);
-  pause (40000);
-  big_text (&screenbase[5 * ROWLENGTH + CENTRE (len1)], word1, 0x3f, 0x0);
-  big_text (&screenbase[15 * ROWLENGTH + CENTRE (len2)], word2, 0x3f, 0x0);
+  big_text (CHARROW (5) + CENTRE (len1), word1, 0xff, 0xc0);
+  big_text (CHARROW (15) + CENTRE (len2), word2, 0xff, 0xc0);
+  wait_frames (LOGO_FRAMES);
+  big_text (CHARROW (5) + CENTRE (len1), word1, 0x3f, 0x0);
+  big_text (CHARROW (15) + CENTRE (len2), word2, 0x3f, 0x0);
 }
 
 //static unsigned rowmultab[32];
 
+/* Clear COUNT character rows starting at FIRST, a page at a time.  Bit 3
+   of each pixel is left alone, so banners stay up.  */
+
+static void
+clear_rows (uint8_t first, uint8_t count)
+{
+  uint8_t *p = charrow[first];
+  uint16_t bytes = ((uint16_t) count << 9) + ((uint16_t) count << 6);
+  uint8_t pages = bytes >> 8, rest = bytes & 255, i;
+
+  while (pages--)
+    {
+      i = 0;
+      do
+        {
+          p[i] &= 0xc0;
+          p[i + 1] &= 0xc0;
+          p[i + 2] &= 0xc0;
+          p[i + 3] &= 0xc0;
+          i += 4;
+        }
+      while (i);
+      p += 256;
+    }
+
+  for (i = 0; i < rest; i++)
+    p[i] &= 0xc0;
+}
+
 static void
 clear (void)
 {
-  unsigned ctr, offset;
-  for (offset = 0; offset < 8; offset++)
-    for (ctr = 0; ctr < ROWLENGTH * 27; ctr += 8)
-      screenbase[ctr+offset] &= 0xc0;
+  ON_BOTH_BUFFERS (clear_rows (0, 27));
+  invalidate_shown ();
+}
+
+/* Level transitions.  The display is cut down to nothing (CRTC R6) while
+   the next level is set up, then opened out again a couple of character
+   rows per frame, so the board is never seen half drawn.  */
+
+#define DISPLAYED_ROWS 28
+
+static void
+hide_screen (void)
+{
+  vdu_var (6, 0);
+}
+
+static void
+reveal_screen (void)
+{
+  uint8_t rows;
+
+  for (rows = 2; rows <= DISPLAYED_ROWS; rows += 2)
+    {
+      wait_frames (1);
+      vdu_var (6, rows);
+    }
 }
 
 /* squidge:
@@ -1185,27 +1593,137 @@ clear (void)
     1, 2, 200, 15
 */
 
+/* Queue a note for the sequencer in swram.S, which plays it from the vsync
+   event.  Arguments are as for SOUND, except that the duration (in 20ths of
+   a second) is limited to about five seconds.  The note is dropped if the
+   queue is full.  */
+
 static void
 sound (int channel, int amplitude, int pitch, int duration)
 {
-  static uint8_t params[8];
-  params[0] = channel & 255;
-  params[1] = (channel >> 8) & 255;
-  params[2] = amplitude & 255;
-  params[3] = (amplitude >> 8) & 255;
-  params[4] = pitch & 255;
-  params[5] = (pitch >> 8) & 255;
-  params[6] = duration & 255;
-  params[7] = (duration >> 8) & 255;
-  osword (7, params);
+  uint8_t tail = snd_tail;
+  uint8_t next = (tail + 4) & (SND_RING_SIZE * 4 - 1);
+  unsigned frames = duration * 2 + duration / 2;
+
+  PROF_BEGIN (PROF_SOUND);
+
+  if (next == snd_head)
+    {
+      PROF_END (PROF_SOUND);
+      return;
+    }
+
+  snd_ring[tail] = channel & 0x13;
+  snd_ring[tail + 1] = amplitude;
+  snd_ring[tail + 2] = pitch;
+  snd_ring[tail + 3] = frames > 255 ? 255 : frames;
+  snd_tail = next;
+  PROF_END (PROF_SOUND);
+}
+
+#if defined(RECORD) || defined(REPLAY)
+#ifdef DOUBLE_BUFFER
+/* The filing system can only load and save the replay from main RAM, and
+   the shadow build has none left for it.  */
+#error "RECORD and REPLAY don't work with DOUBLE_BUFFER"
+#endif
+
+/* A replay is the seed and level number a level started with, then every
+   key read while playing it.  RECORD builds seed each level from the
+   system clock and save its replay (as REPLAY) when it ends; a long level
+   is only recorded as far as REPLAY_KEYS keys.  REPLAY builds load one
+   and play it back through the same input path, and the level ends when
+   its keys run out (if it hasn't already).  Under bench65, that times
+   every move and cascade in it.  */
+
+#define REPLAY_KEYS 512
+#define REPLAY_SEED 0
+#define REPLAY_LEVEL 2
+#define REPLAY_COUNT 3
+#define REPLAY_HEADER 5
+
+static uint8_t replay[REPLAY_HEADER + REPLAY_KEYS];
+
+/* Initialised data, so in main RAM: the filing system can't see a string
+   constant in our bank.  */
+static char replay_name[] = "REPLAY\r";
+
+static uint16_t
+replay_count (void)
+{
+  return replay[REPLAY_COUNT] | (replay[REPLAY_COUNT + 1] << 8);
+}
+#endif
+
+#ifdef RECORD
+static void
+replay_start (uint8_t levelno)
+{
+  static uint8_t clock[5];
+  uint16_t seed;
+
+  osword (1, clock);
+  seed = clock[0] | (clock[1] << 8);
+  rng_seed (seed);
+
+  replay[REPLAY_SEED] = seed & 255;
+  replay[REPLAY_SEED + 1] = seed >> 8;
+  replay[REPLAY_LEVEL] = levelno;
+  replay[REPLAY_COUNT] = replay[REPLAY_COUNT + 1] = 0;
+}
+
+static void
+record_key (uint8_t key)
+{
+  uint16_t count = replay_count ();
+
+  if (count == REPLAY_KEYS)
+    return;
+
+  replay[REPLAY_HEADER + count++] = key;
+  replay[REPLAY_COUNT] = count & 255;
+  replay[REPLAY_COUNT + 1] = count >> 8;
+}
+
+static void
+replay_save (void)
+{
+  osfile_save (replay_name, replay, replay + REPLAY_HEADER + replay_count ());
 }
+#endif
+
+#ifdef REPLAY
+static uint16_t replay_pos;
+
+/* Seed the RNG as the replay was, and return its level.  */
+
+static uint8_t
+replay_load (void)
+{
+  osfile_load (replay_name, replay);
+  rng_seed (replay[REPLAY_SEED] | (replay[REPLAY_SEED + 1] << 8));
+  return replay[REPLAY_LEVEL];
+}
+
+/* The replay's next key, or -1 when it has run out.  */
+
+static int
+replay_key (void)
+{
+  if (replay_pos < replay_count ())
+    return replay[REPLAY_HEADER + replay_pos++];
+
+  return -1;
+}
+#endif
 
 static void
 init_level (uint8_t levelno)
 {
-  char *levdata = tiles[LEVEL1_PTR + levelno - 1];
-  movesleft = levdata[0];
-  memcpy (background, &levdata[1], 9 * 9);
+  uint8_t moves = load_level (tiles[LEVEL1_PTR + levelno - 1]);
+
+  bcd_args (movesleft, sizeof (movesleft), moves);
+  bcd_from_binary ();
 }
 
 static uint8_t
@@ -1217,12 +1735,19 @@ play_level (uint8_t levelno)
   uint8_t selected = 0;
   uint8_t i;
 
+  hide_screen ();
+
   init_level (levelno);
 
-  memset (&screenbase[ROWLENGTH*27], 0x30, ROWLENGTH);
-  memcpy (&screenbase[ROWLENGTH*27 + 2 * 8], tiles[MOVES_TEXT], 11 * 8);
-  memcpy (&screenbase[ROWLENGTH*27 + 23 * 8], tiles[JELLY_TEXT], 8 * 8);
-  memcpy (&screenbase[ROWLENGTH*27 + 39 * 8], tiles[SCORE_TEXT], 10 * 8);
+  ON_BOTH_BUFFERS (
+    memset (STATUS_ROW, 0x30, ROWLENGTH);
+    memcpy (STATUS_ROW + 2 * 8, tiles[MOVES_TEXT], 11 * 8);
+    memcpy (STATUS_ROW + 23 * 8, tiles[JELLY_TEXT], 8 * 8);
+    memcpy (STATUS_ROW + 39 * 8, tiles[SCORE_TEXT], 10 * 8));
+  memset (hud_digits, 255, sizeof (hud_digits));
+#ifdef PROFILE
+  prof_shown = 0;
+#endif
 
   //thescore = 0;
 
@@ -1231,55 +1756,49 @@ play_level (uint8_t levelno)
 
   selected_state (0);
 
-  do
-    {
-      for (y = 0; y < 9; y++)
-        for (x = 0; x < 9; x++)
-          playfield[y][x] = 255;
+#ifdef RECORD
+  replay_start (levelno);
+#endif
 
-      for (y = 0; y < 9; y++)
-        for (x = 0; x < 9; x++)
-          {
-            uint8_t thistile;
-            do
-              {
-                if (background[y][x] & SWIRL_MASK)
-                  thistile = SWIRL_TILE;
-                else if ((background[y][x] & BG_MASK) == 3)
-                  thistile = EMPTY_TILE;
-                else
-                  thistile = rng ();
-                playfield[y][x] = thistile;
-              }
-            while (horizontal_match (x, y, thistile, 0) >= 3
-                   || vertical_match (x, y, thistile, 0) >= 3);
-          }
-    }
-  while (reshuffle_needed ());
+  generate_board ();
 
   reset_playfield_marks ();
 
-  for (y = 0; y < 9; y++)
-    for (x = 0; x < 9; x++)
-      redraw_tile (x, y);
+  invalidate_shown ();
+  mark_all_dirty ();
+  flush_dirty ();
 
   // Box!
   //gfx_gcol (1, 8);
   box (cursx, cursy, 0xff, 0xc0);
 
+  reveal_screen ();
+
   // Flush input buffer.
   osbyte (15, 1, 0);
 
-  if (reshuffle_needed ())
+  if (PROF_CALL (PROF_RESHUFFLE, reshuffle_needed ()))
     return 1;
 
-  while (movesleft > 0 && jellies > 0)
+  while ((movesleft[0] || movesleft[1]) && jellies)
     {
       uint8_t readchar;
       oldcx = cursx;
       oldcy = cursy;
 
-      readchar = osrdch ();
+#ifdef REPLAY
+      {
+        int key = replay_key ();
+        if (key < 0)
+          break;
+        readchar = key;
+      }
+#else
+      readchar = read_key (cursx, cursy);
+#endif
+#ifdef RECORD
+      record_key (readchar);
+#endif
 
       switch (readchar)
         {
@@ -1317,7 +1836,7 @@ play_level (uint8_t levelno)
           else if (readchar == 'w' || readchar == 'W')
             make_special (WRAP_TILES, &playfield[y][x]);
           else
-            playfield[cursy][cursx] = readchar - '1';
+            set_tile (cursx, cursy, readchar - '1');
           redraw_tile (cursx, cursy);
           box (cursx, cursy, 0xff, 0xc0);
           break;
@@ -1329,6 +1848,11 @@ play_level (uint8_t levelno)
           selected = !selected;
           selected_state (selected);
           break;
+#ifdef PROFILE
+        case 'p': case 'P':
+          prof_next ();
+          break;
+#endif
         default:
           ;
         }
@@ -1337,8 +1861,11 @@ play_level (uint8_t levelno)
         {
           uint8_t selected_tile = playfield[oldcy][oldcx];
 
+          TRACE (TRACE_MOVE_START);
+
           if (selected
-              && successful_move (oldcx, oldcy, cursx, cursy))
+              && PROF_CALL (PROF_MATCH,
+                            successful_move (oldcx, oldcy, cursx, cursy)))
             {
               uint8_t retriggers = 0;
               uint8_t plus_sound = 66;
@@ -1350,7 +1877,7 @@ play_level (uint8_t levelno)
 
               while (1)
                 {
-                  while (retrigger ())
+                  while (PROF_CALL (PROF_MATCH, retrigger ()))
                     {
                       sound (0x12, 1, plus_sound, 10);
                       do_explosions ();
@@ -1358,7 +1885,7 @@ play_level (uint8_t levelno)
                       plus_sound += 16;
                     }
 
-                  if (!reshuffle_needed ())
+                  if (!PROF_CALL (PROF_RESHUFFLE, reshuffle_needed ()))
                     break;
 
                   reshuffle ();
@@ -1374,9 +1901,12 @@ play_level (uint8_t levelno)
               selected = 0;
               selected_state (selected);
 
-              movesleft--;
+              bcd_args (movesleft, sizeof (movesleft), 1);
+              bcd_sub ();
               count_jelly ();
               refresh_status ();
+
+              TRACE (TRACE_MOVE_END);
             }
           else
             {
@@ -1399,7 +1929,11 @@ play_level (uint8_t levelno)
 
   box (cursx, cursy, 0x3f, 0x0);
 
-  return movesleft > 0;
+#ifdef RECORD
+  replay_save ();
+#endif
+
+  return movesleft[0] || movesleft[1];
 }
 
 typedef struct
@@ -1452,20 +1986,193 @@ static envelope env3 =
 
 static envelope *envs[] = { &env1, &env2, &env3 };
 
+/* Expand an ENVELOPE definition into per-frame tables for the sequencer,
+   following the OS's rules: the pitch sections run in turn (repeating unless
+   bit 7 of the step length is set), and the amplitude goes through attack
+   and decay to the sustain phase.  The OS steps envelopes every centisecond
+   but we only look at every other one.  */
+
+static void
+expand_envelope (envelope *env)
+{
+  int8_t *pitch_delta = &env->pitch_delta_1;
+  uint8_t *steps = &env->steps_1;
+  int8_t *amp_delta = &env->amp_delta_attack;
+  uint8_t *target = &env->attack_target;
+  uint8_t steplen = env->steplen & 127;
+  uint8_t countdown = steplen;
+  uint8_t section = 0, step = 0, phase = 0;
+  uint8_t pitch = 0, cs;
+  int amp = 0;
+  uint8_t base = (env->num - 1) * SND_ENV_TICKS;
+  uint8_t t;
+
+  for (t = 0; t < SND_ENV_TICKS; t++)
+    {
+      snd_env_pitch[base + t] = pitch;
+      snd_env_atten[base + t] = 15 - (amp >> 3);
+
+      for (cs = 0; cs < 2; cs++)
+        {
+          if (--countdown != 0)
+            continue;
+          countdown = steplen;
+
+          if (section < 3)
+            {
+              if (step < steps[section])
+                {
+                  pitch += pitch_delta[section];
+                  step++;
+                }
+              if (step >= steps[section])
+                {
+                  step = 0;
+                  if (++section == 3 && !(env->steplen & 128))
+                    section = 0;
+                }
+            }
+
+          amp += amp_delta[phase];
+          if (phase < 2)
+            {
+              if ((amp_delta[phase] >= 0 && amp >= target[phase])
+                  || (amp_delta[phase] < 0 && amp <= target[phase]))
+                {
+                  amp = target[phase];
+                  phase++;
+                }
+            }
+          if (amp < 0)
+            amp = 0;
+          else if (amp > 126)
+            amp = 126;
+        }
+    }
+}
+
 static void
 config_envelopes (void)
 {
   uint8_t i;
+
+  snd_init ();
+  /* Silence all four channels.  */
+  for (i = 0; i < 4; i++)
+    sound_chip_write (0x9f | (i << 5));
+
   for (i = 0; i < 3; i++)
-    osword (8, envs[i]);
+    expand_envelope (envs[i]);
+}
+
+#ifdef BENCHMARK
+/* Benchmark builds (see mkbench.sh) time some of the hot routines on fixed
+   inputs under bench65, which counts the cycles between a write to
+   BENCH_START and one to BENCH_STOP, and reads the name of each from
+   BENCH_NAME.  "overhead" times nothing and is taken off the rest.  */
+
+static void
+bench_start (const char *name)
+{
+  WRITE_BYTE (BENCH_NAME, (unsigned) name & 255);
+  WRITE_BYTE (BENCH_NAME + 1, (unsigned) name >> 8);
+  WRITE_BYTE (BENCH_START, 0);
+}
+
+#define BENCH(NAME, CALL)		\
+  do					\
+    {					\
+      bench_start (NAME);		\
+      CALL;				\
+      WRITE_BYTE (BENCH_STOP, 0);	\
+    }					\
+  while (0)
+
+static void
+run_benchmarks (void)
+{
+  static uint8_t number[5] = { 0x89, 0x67, 0x45, 0x23, 0x01 };
+  static uint8_t shown[9];
+  static volatile uint8_t cellx = 4, celly = 4;
+  static uint8_t *volatile celladdr;
+  uint8_t *cell = CELL_ADDR (4, 4);
+  uint8_t colour, x;
+
+  rng_seed (RNG_SEED);
+  init_level (1);
+  generate_board ();
+  reset_playfield_marks ();
+  invalidate_shown ();
+
+  BENCH ("overhead", );
+
+  BENCH ("render_tile compiled", render_tile (cell, PLAIN_TILES));
+  BENCH ("render_tile rle", render_tile (cell, H_TILES));
+  BENCH ("render_tile cage", render_tile (cell, CAGE_TILE));
+  BENCH ("render_solid_tile", render_solid_tile (cell, BG_TILES));
+
+#ifdef TILE_CACHE
+  cache_init ();
+#endif
+  BENCH ("redraw_tile", redraw_tile (4, 4));
+#ifdef TILE_CACHE
+  invalidate_shown ();
+  BENCH ("redraw_tile cached", redraw_tile (4, 4));
+#endif
+
+  /* A cell's screen address, multiplied out as redraw_tile used to and
+     from the tables it uses now.  */
+  BENCH ("cell address multiply",
+         celladdr = screenbase + celly * ROWLENGTH * 3 + cellx * 64);
+  BENCH ("cell address table", celladdr = CELL_ADDR (cellx, celly));
+
+  /* A freshly generated board has no runs.  Then make one of exactly three
+   along the bottom row, in a colour which is neither beside the three
+   cells nor above any of them.  That rules out at most five of the six.  */
+  BENCH ("retrigger none", retrigger ());
+  for (colour = 0; colour < 6; colour++)
+    if (colour != playfield[8][0] && colour != playfield[8][4]
+        && colour != playfield[7][1] && colour != playfield[7][2]
+        && colour != playfield[7][3])
+      break;
+  for (x = 1; x <= 3; x++)
+    set_tile (x, 8, colour);
+  BENCH ("retrigger run", retrigger ());
+  reset_playfield_marks ();
+
+  invalidate_moves ();
+  BENCH ("reshuffle_needed rebuild", reshuffle_needed ());
+  BENCH ("reshuffle_needed unchanged", reshuffle_needed ());
+
+  memset (shown, 255, sizeof (shown));
+  BENCH ("write_number", write_number (STATUS_ROW + 51 * 8, number, 9, shown));
+  BENCH ("write_number unchanged",
+         write_number (STATUS_ROW + 51 * 8, number, 9, shown));
+
+  BENCH ("big_text", big_text (CHARROW (10) + CENTRE (9), "Reshuffle", 0xff,
+                               0xc0));
+  BENCH ("big_text cached glyphs",
+         big_text (CHARROW (10) + CENTRE (9), "Reshuffle", 0x3f, 0x0));
+
+  WRITE_BYTE (BENCH_DONE, 0);
 }
+#endif
 
 int main (void)
 {
   int win;
   uint8_t current_level = 1;
 
+  rng_seed (RNG_SEED);
   config_envelopes ();
+  frame_clock_init ();
+#ifdef PROFILE
+  prof_init ();
+#endif
+
+#ifdef TILE_CACHE
+  cache_init ();
+#endif
 
 #ifdef ROM
   //osfile_load ("tiles\r", (void*) 0xe00);
@@ -1482,7 +2189,7 @@ int main (void)
   screen_start (screenbase);
   vdu_var (1, 72); // horizontal displayed
   vdu_var (2, 94); // horizontal sync position
-  vdu_var (6, 28); // vertical displayed
+  vdu_var (6, DISPLAYED_ROWS); // vertical displayed
   vdu_var (7, 32); // vertical sync position
 
   /* Unfortunately this doesn't really work -- not sure if you can make the
@@ -1502,6 +2209,11 @@ int main (void)
   WRITE_BYTE (0xe1, ((unsigned) &rowmultab[0]) >> 8);*/
 
 
+#ifdef DOUBLE_BUFFER
+  /* Only main RAM has been cleared by the mode change.  */
+  clear ();
+#endif
+
   /* Cursor keys produce character codes.  */
   osbyte (4, 1, 0);
 
@@ -1509,23 +2221,34 @@ int main (void)
   osbyte (9, 4, 0);
   osbyte (10, 4, 0);
 
+#ifdef BENCHMARK
+  run_benchmarks ();
+#endif
+
+#ifdef REPLAY
+  current_level = replay_load ();
+#endif
+
   do
     {
       win = play_level (current_level);
+      /* In a REPLAY build, the replay is over: its level has been won or
+         lost, or its keys have run out.  */
+      TRACE (TRACE_REPLAY_END);
 
       if (win)
         {
           write_exciting_logo (0);
           write_exciting_logo (2);
           selected_state (0);
-          big_text (&screenbase[10*ROWLENGTH+CENTRE (4)], "WIN!", 0x0, 0xc0);
+          big_text (CHARROW (10) + CENTRE (4), BANNER ("WIN!"), 0x0, 0xc0);
 
           /* You shall be stuck on the final level forever.  */
           if (tiles[LEVEL1_PTR + current_level] != 0)
             current_level++;
         }
       else
-        big_text (&screenbase[10*ROWLENGTH+CENTRE (6)], "Failed", 0x0, 0xc0);
+        big_text (CHARROW (10) + CENTRE (6), BANNER ("Failed"), 0x0, 0xc0);
 
       clear ();
       osrdch ();
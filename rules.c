@@ -0,0 +1,1434 @@
+#include <string.h>
+
+#include "rules.h"
+
+/* Random numbers come from a 16-bit xorshift generator (shifts 7, 9 and 8),
+   worked a byte at a time so each shift is a single bit or a whole byte.
+   rng_seed sets the state, so a game can be played again exactly.  */
+
+static uint8_t rng_lo = RNG_SEED & 255, rng_hi = RNG_SEED >> 8;
+
+void
+rng_seed (uint16_t seed)
+{
+  /* Zero would stay zero for ever.  */
+  if (!seed)
+    seed = RNG_SEED;
+
+  rng_lo = seed & 255;
+  rng_hi = seed >> 8;
+}
+
+static uint8_t
+rng_byte (void)
+{
+  uint8_t lo = rng_lo, hi = rng_hi;
+
+  /* x ^= x << 7 */
+  hi ^= (lo >> 1) | (uint8_t) (hi << 7);
+  lo ^= (uint8_t) (lo << 7);
+  /* x ^= x >> 9 */
+  lo ^= hi >> 1;
+  /* x ^= x << 8 */
+  hi ^= lo;
+
+  rng_lo = lo;
+  rng_hi = hi;
+
+  return hi;
+}
+
+/* A random number from 0 to N - 1, scaling rather than dividing.  */
+
+static uint8_t
+rng_range (uint8_t n)
+{
+  return ((uint16_t) rng_byte () * n) >> 8;
+}
+
+/* A random candy colour, 0 to 5: a byte times 6, over 256.  */
+
+static uint8_t
+rng (void)
+{
+  return ((uint16_t) rng_byte () * 3) >> 7;
+}
+
+uint8_t playfield[9][9];
+
+#if 1
+uint8_t background[9][9] =
+  {
+    { 0, 0, 0, 0, 0, 0, 0, 0, 0 },
+    { 0, 0, 0, 0, 0, 0, 0, 0, 0 },
+    { 0, 0, 0, 0, 0, 0, 0, 0, 0 },
+    { 0, 0, 0, 0, 1, 0, 0, 0, 0 },
+    { 0, 0, 0, 1, 1, 1, 0, 0, 0 },
+    { 0, 0, 0, 0, 1, 0, 0, 0, 0 },
+    { 0, 0, 0, 0, 0, 0, 0, 0, 0 },
+    { 0, 0, 0, 0, 0, 0, 0, 0, 0 },
+    { 0, 0, 0, 0, 0, 0, 0, 0, 0 }
+  };
+#else
+
+#define S SWIRL_MASK
+#define C CAGE_MASK
+
+#if 0
+
+uint8_t background[9][9] =
+  {
+    { 0, 0, 0, 0, 0, 0, 0, 0, 0 },
+    { 0, 0, 0, 0, 0, 0, 0, 0, 0 },
+    { 0, 0, 0, 0, 0, 0, 0, 0, 0 },
+    { 0, 0, 0, 0, 0, 0, 0, 0, 0 },
+    { 0, 0, 0, S, S, S, 0, 0, 0 },
+    { 0, 0, 0, 0, 0, 0, 0, 0, 0 },
+    { C, 0, 0, 0, 0, 0, 0, 0, C },
+    { 1|C, 0, 0, 0, 0, 0, 0, 0, 1|C },
+    { 2|C, 2|C, 0, 0, 0, 0, 0, 2|C, 2|C }
+  };
+
+#else
+
+uint8_t background[9][9] =
+  {
+    { 0, 0, 0, 0, 0, 0, 0, 0, 0 },
+    { 0, 0, 0, 0, 0, 0, 0, 0, 0 },
+    { 0, 0, 0, 0, 0, 0, 0, 0, 0 },
+    { 0, 0, 0, 0, 0, 0, 0, 0, 0 },
+    { S, S, S, S, S, S, S, S, S },
+    { C, C, C, C, C, C, C, C, C },
+    { 0, 0, 0, 0, 0, 0, 0, 0, 0 },
+    { 1, 1, 1, 1, 1, 1, 1, 1, 1 },
+    { 1, 1, 1, 1, 1, 1, 1, 1, 1 }
+  };
+
+#endif
+
+#undef C
+#undef H
+
+#endif
+
+const uint16_t cellbit[9] =
+  {
+    1, 2, 4, 8, 16, 32, 64, 128, 256
+  };
+
+/* What each playfield byte is, in one byte: the colour (NO_COLOUR if it
+   doesn't match anything), the kind of tile, ATTR_SPECIAL for striped and
+   wrapped candies, and ATTR_WILD for tiles which can be swapped with
+   anything (colour bombs, and holes).  The kinds of special candy are in
+   the order of their blasts (see trigger).  Exploding tiles (with the top
+   bit set) are the same as the others.  */
+
+#define ATTR_COLOUR 0x07
+#define ATTR_KIND 0x38
+#define ATTR_SPECIAL 0x40
+#define ATTR_WILD 0x80
+
+#define NO_COLOUR 7
+
+#define KIND_PLAIN 0x00
+#define KIND_H 0x08
+#define KIND_V 0x10
+#define KIND_WRAP 0x18
+#define KIND_BOMB 0x20
+#define KIND_SWIRL 0x28
+#define KIND_EMPTY 0x30
+#define KIND_OTHER 0x38
+
+#define CANDIES(KIND) \
+  KIND | 0, KIND | 1, KIND | 2, KIND | 3, KIND | 4, KIND | 5
+
+#define TILE_ATTRS \
+  CANDIES (KIND_PLAIN), \
+  CANDIES (KIND_V | ATTR_SPECIAL), \
+  CANDIES (KIND_H | ATTR_SPECIAL), \
+  CANDIES (KIND_WRAP | ATTR_SPECIAL), \
+  KIND_SWIRL | NO_COLOUR, \
+  KIND_OTHER | NO_COLOUR, \
+  KIND_BOMB | ATTR_WILD | NO_COLOUR, \
+  KIND_OTHER | NO_COLOUR, \
+  KIND_OTHER | NO_COLOUR, KIND_OTHER | NO_COLOUR, KIND_OTHER | NO_COLOUR, \
+  KIND_EMPTY | ATTR_WILD | NO_COLOUR
+
+static const uint8_t tile_attr[256] =
+  {
+    TILE_ATTRS,
+    [32 ... 127] = KIND_OTHER | NO_COLOUR,
+    TILE_ATTRS,
+    [160 ... 255] = KIND_OTHER | NO_COLOUR
+  };
+
+#undef CANDIES
+#undef TILE_ATTRS
+
+#define TILE_ATTR(T) (tile_attr[(uint8_t) (T)])
+#define TILE_COLOUR(T) (TILE_ATTR (T) & ATTR_COLOUR)
+#define TILE_KIND(T) (TILE_ATTR (T) & ATTR_KIND)
+
+static uint8_t
+candy_match (uint8_t lhs, uint8_t rhs)
+{
+  uint8_t colour = TILE_COLOUR (lhs);
+
+  return colour != NO_COLOUR && colour == TILE_COLOUR (rhs);
+}
+
+#ifdef BITBOARDS
+/* Bit X of colour_bits[C][Y] is set if playfield[Y][X] is a candy of colour
+   C.  Cells change colour only through set_tile (or are followed by a call
+   to build_bitboards), so these are always up to date.  Exploding cells
+   keep their colour.  */
+static uint16_t colour_bits[6][9];
+
+static void
+build_bitboards (void)
+{
+  uint8_t x, y, colour;
+
+  memset (colour_bits, 0, sizeof (colour_bits));
+
+  for (y = 0; y < 9; y++)
+    for (x = 0; x < 9; x++)
+      {
+        colour = TILE_COLOUR (playfield[y][x]);
+        if (colour != NO_COLOUR)
+          colour_bits[colour][y] |= cellbit[x];
+      }
+}
+
+/* The three-in-a-row windows which include each column (all bits set for
+   those which would go off the board, so they never match).  */
+static const uint16_t run_windows[9][3] =
+  {
+    { 0xffff, 0xffff, 0x007 },
+    { 0xffff, 0x007, 0x00e },
+    { 0x007, 0x00e, 0x01c },
+    { 0x00e, 0x01c, 0x038 },
+    { 0x01c, 0x038, 0x070 },
+    { 0x038, 0x070, 0x0e0 },
+    { 0x070, 0x0e0, 0x1c0 },
+    { 0x0e0, 0x1c0, 0xffff },
+    { 0x1c0, 0xffff, 0xffff }
+  };
+
+/* Whether (X, Y) is part of a run of three or more.  */
+
+static uint8_t
+cell_in_run (uint8_t x, uint8_t y)
+{
+  uint8_t colour = TILE_COLOUR (playfield[y][x]), i, column = 0;
+  const uint16_t *rows, *windows = run_windows[x];
+  uint16_t bits;
+
+  if (colour == NO_COLOUR)
+    return 0;
+
+  rows = colour_bits[colour];
+  bits = rows[y];
+  if ((bits & windows[0]) == windows[0]
+      || (bits & windows[1]) == windows[1]
+      || (bits & windows[2]) == windows[2])
+    return 1;
+
+  /* Gather this column, two cells either side, into a row.  */
+  for (i = 0; i < 5; i++)
+    if (y + i >= 2 && y + i < 11 && (rows[y + i - 2] & cellbit[x]))
+      column |= cellbit[i];
+
+  windows = run_windows[2];
+  return (column & windows[0]) == windows[0]
+         || (column & windows[1]) == windows[1]
+         || (column & windows[2]) == windows[2];
+}
+#endif
+
+/* Change the tile in a cell.  Use this (rather than writing to playfield)
+   wherever a cell might change colour.  */
+
+void
+set_tile (uint8_t x, uint8_t y, uint8_t tile)
+{
+#ifdef BITBOARDS
+  uint8_t was = TILE_COLOUR (playfield[y][x]), now = TILE_COLOUR (tile);
+
+  if (was != now)
+    {
+      if (was != NO_COLOUR)
+        colour_bits[was][y] &= ~cellbit[x];
+      if (now != NO_COLOUR)
+        colour_bits[now][y] |= cellbit[x];
+    }
+#endif
+
+  playfield[y][x] = tile;
+}
+
+static void
+explode_a_colour (uint8_t c)
+{
+  uint8_t x, y;
+#ifdef BITBOARDS
+  uint8_t colour = TILE_COLOUR (c);
+  uint16_t bits;
+
+  if (colour == NO_COLOUR)
+    return;
+
+  for (y = 0; y < 9; y++)
+    if ((bits = colour_bits[colour][y]) != 0)
+      for (x = 0; x < 9; x++)
+        if (bits & cellbit[x])
+          playfield[y][x] |= 128;
+#else
+  for (y = 0; y < 9; y++)
+    for (x = 0; x < 9; x++)
+      {
+        if (candy_match (playfield[y][x], c))
+          playfield[y][x] |= 128;
+      }
+#endif
+}
+
+static void trigger (uint8_t, uint8_t, uint8_t);
+
+static uint8_t
+stripes_match (uint8_t oldx, uint8_t oldy, uint8_t newx, uint8_t newy, uint8_t fix_move)
+{
+  uint8_t lhs = playfield[oldy][oldx], rhs = playfield[newy][newx];
+  uint8_t i;
+
+  if (TILE_ATTR (lhs) & TILE_ATTR (rhs) & ATTR_SPECIAL)
+    {
+      if (fix_move)
+        {
+          for (i = 0; i < 9; i++)
+            {
+              trigger (i, oldy, lhs);
+              trigger (oldx, i, lhs);
+              trigger (i, newy, rhs);
+              trigger (newx, i, rhs);
+            }
+          add_score (0x03);
+        }
+      return 1;
+    }
+
+  return 0;
+}
+
+static uint8_t
+colourbomb_match (uint8_t *lhsp, uint8_t *rhsp, uint8_t fix_move)
+{
+  uint8_t lhs = *lhsp, rhs = *rhsp;
+
+  if (lhs == COLOURBOMB_TILE)
+    {
+      if (fix_move && TILE_COLOUR (rhs) != NO_COLOUR)
+        {
+          *lhsp |= 128;
+          explode_a_colour (rhs);
+        }
+
+      if (fix_move)
+        add_score (0x03);
+
+      return 1;
+    }
+  else if (rhs == COLOURBOMB_TILE)
+    {
+      if (fix_move && TILE_COLOUR (lhs) != NO_COLOUR)
+        {
+          *rhsp |= 128;
+          explode_a_colour (lhs);
+        }
+
+      if (fix_move)
+        add_score (0x03);
+
+      return 1;
+    }
+
+  return 0;
+}
+
+/* Set off a special candy: mark it as exploding, score it, and say which
+   cells it takes with it (KIND_H, KIND_V or KIND_WRAP, or 0 for none).  A
+   colour bomb takes every candy of colour EQ straight away (without setting
+   those off in turn).  */
+
+static uint8_t
+detonate (uint8_t x, uint8_t y, uint8_t eq)
+{
+  uint8_t kind = TILE_KIND (playfield[y][x]);
+
+  playfield[y][x] |= 128;
+  add_score (0x01);
+
+  if (kind == KIND_BOMB)
+    explode_a_colour (eq);
+  else if (kind <= KIND_WRAP)
+    return kind;
+
+  return 0;
+}
+
+/* Cells around a wrapped candy, in the order they're set off.  */
+static const int8_t wrap_dx[9] = { -1, -1, -1, 0, 0, 0, 1, 1, 1 };
+static const int8_t wrap_dy[9] = { -1, 0, 1, -1, 0, 1, -1, 0, 1 };
+
+/* Each blast in progress, and how far through its nine cells it is.  A
+   cell is marked when it goes on here, so there can't be more of these
+   than cells on the board.  */
+static uint8_t blast_x[81], blast_y[81], blast_kind[81], blast_step[81];
+
+/* Explode (X, Y) and everything it sets off in turn.  This works through
+   the blasts depth first, exactly as a recursive version would (so the same
+   cells explode and score), but without using any stack.  */
+
+static void
+trigger (uint8_t x, uint8_t y, uint8_t eq)
+{
+  uint8_t depth = 0, top, kind, step;
+
+  kind = detonate (x, y, eq);
+
+  while (1)
+    {
+      if (kind)
+        {
+          blast_x[depth] = x;
+          blast_y[depth] = y;
+          blast_kind[depth] = kind;
+          blast_step[depth] = 0;
+          depth++;
+        }
+
+      if (depth == 0)
+        break;
+
+      top = depth - 1;
+      step = blast_step[top]++;
+      kind = 0;
+
+      if (step == 9)
+        {
+          depth--;
+          continue;
+        }
+
+      switch (blast_kind[top])
+        {
+        case KIND_H:
+          x = step;
+          y = blast_y[top];
+          break;
+
+        case KIND_V:
+          x = blast_x[top];
+          y = step;
+          break;
+
+        default:
+          x = blast_x[top] + wrap_dx[step];
+          y = blast_y[top] + wrap_dy[step];
+          /* Off the edge (this catches -1 too).  */
+          if (x > 8 || y > 8)
+            continue;
+        }
+
+      if (!(playfield[y][x] & 128))
+        kind = detonate (x, y, eq);
+    }
+}
+
+static uint8_t
+horizontal_match (uint8_t x, uint8_t y, uint8_t eq, uint8_t fix_matches)
+{
+  uint8_t c;
+  uint8_t right = x, left = x, matching;
+  
+  for (c = x + 1; c < 9; c++)
+    {
+      if (candy_match (playfield[y][c], eq))
+        right = c;
+      else
+        break;
+    }
+
+  for (c = x - 1; c != 255; c--)
+    {
+      if (candy_match (playfield[y][c], eq))
+        left = c;
+      else
+        break;
+    }
+
+  matching = right - left + 1;
+
+  if (fix_matches && matching >= 3)
+    {
+      for (x = left; x <= right; x++)
+        trigger (x, y, eq);
+    }
+
+  return matching;
+}
+
+static uint8_t
+vertical_match (uint8_t x, uint8_t y, uint8_t eq, uint8_t fix_matches)
+{
+  uint8_t c;
+  uint8_t bottom = y, top = y, matching;
+  
+  for (c = y + 1; c < 9; c++)
+    {
+      if (candy_match (playfield[c][x], eq))
+        bottom = c;
+      else
+        break;
+    }
+
+  for (c = y - 1; c != 255; c--)
+    {
+      if (candy_match (playfield[c][x], eq))
+        top = c;
+      else
+        break;
+    }
+
+  matching = bottom - top + 1;
+
+  if (fix_matches && matching >= 3)
+    {
+      for (y = top; y <= bottom; y++)
+        trigger (x, y, eq);
+    }
+
+  return matching;
+}
+
+void
+reset_playfield_marks (void)
+{
+  uint8_t x, y;
+  for (y = 0; y < 9; y++)
+    for (x = 0; x < 9; x++)
+      playfield[y][x] &= ~128;
+}
+
+static void
+do_swap (uint8_t oldx, uint8_t oldy, uint8_t newx, uint8_t newy)
+{
+  uint8_t oldtile = playfield[oldy][oldx];
+  set_tile (oldx, oldy, playfield[newy][newx]);
+  set_tile (newx, newy, oldtile);
+}
+
+static void
+deswirl (uint8_t x, uint8_t y)
+{
+  background[y][x] &= ~SWIRL_MASK;
+  set_tile (x, y, EMPTY_TILE);
+  mark_dirty (x, y);
+  add_score (0x10);
+}
+
+/* Remove exploded candies (and the cages, swirls and jelly they take with
+   them).  This only marks cells for redrawing, so it can be done while the
+   explosions are still on screen.  */
+
+void
+clear_explosions (void)
+{
+  uint8_t x, y;
+
+  for (y = 0; y < 9; y++)
+    for (x = 0; x < 9; x++)
+      {
+        if (playfield[y][x] & 128)
+          {
+            set_tile (x, y, EMPTY_TILE);
+
+            if (background[y][x] & CAGE_MASK)
+              {
+                background[y][x] &= ~CAGE_MASK;
+                mark_dirty (x, y);
+                add_score (0x20);
+              }
+
+            if (x > 0 && (background[y][x - 1] & SWIRL_MASK))
+              deswirl (x - 1, y);
+            if (x < 8 && (background[y][x + 1] & SWIRL_MASK))
+              deswirl (x + 1, y);
+            if (y > 0 && (background[y - 1][x] & SWIRL_MASK))
+              deswirl (x, y - 1);
+            if (y < 8 && (background[y + 1][x] & SWIRL_MASK))
+              deswirl (x, y + 1);
+
+            // Remove jelly (like a boss).
+            if (background[y][x] > 0 && background[y][x] <= 2)
+              {
+                add_score (0x10);
+                background[y][x]--;
+              }
+          }
+      }
+}
+
+/* How far the candy which ends up at (X, Y) falls, once settle_columns has
+   run.  New candies count from the row above the board they'd have been
+   in; 0 means nothing moves into the cell.  */
+static uint8_t fall[9][9];
+
+/* How many new candies drop in at the top of each column.  */
+static uint8_t new_candies[9];
+
+/* Work out where everything will land, with one pass up each column.  A
+   candy falls into the holes below it, but not past a cage or swirl (which
+   can be filled from above but stay put themselves).  Holes in the top
+   part of the column are filled with new candies.  Returns the furthest
+   anything falls.  */
+
+static uint8_t
+settle_columns (void)
+{
+  uint8_t x, y, to, holes, furthest = 0;
+
+  for (x = 0; x < 9; x++)
+    {
+      /* The next row to fill.  */
+      to = 8;
+
+      for (y = 8; y != 255; y--)
+        {
+          fall[y][x] = 0;
+
+          /* Nothing gets past, so any holes below stay empty.  */
+          if (background[y][x] & ~BG_MASK)
+            to = y;
+
+          if (playfield[y][x] != EMPTY_TILE)
+            {
+              fall[to][x] = to - y;
+              if (to - y > furthest)
+                furthest = to - y;
+              to--;
+            }
+        }
+
+      holes = to + 1;
+      new_candies[x] = holes;
+      for (y = 0; y < holes; y++)
+        fall[y][x] = holes;
+
+      if (holes > furthest)
+        furthest = holes;
+    }
+
+  return furthest;
+}
+
+/* Move everything which is still falling down by a row: on step STEP, the
+   candy ending up at (X, Y) has got to row Y - fall[Y][X] + STEP.  */
+
+static void
+fall_step (uint8_t step)
+{
+  uint8_t x, y, at;
+
+  for (y = 8; y > 0; y--)
+    for (x = 0; x < 9; x++)
+      {
+        if (fall[y][x] < step)
+          continue;
+
+        /* At or above the top row: a new candy, added below.  */
+        if (y + step <= fall[y][x])
+          continue;
+
+        at = y + step - fall[y][x];
+        set_tile (x, at, playfield[at - 1][x]);
+        set_tile (x, at - 1, EMPTY_TILE);
+        fall_by_copy (x, at);
+        mark_dirty (x, at);
+        mark_dirty (x, at - 1);
+      }
+
+  for (x = 0; x < 9; x++)
+    if (new_candies[x] >= step)
+      {
+        set_tile (x, 0, rng ());
+        mark_dirty (x, 0);
+      }
+}
+
+void
+shuffle_explosions (void)
+{
+  uint8_t x, y, furthest, step;
+
+  for (y = 0; y < 9; y++)
+    for (x = 0; x < 9; x++)
+      if (playfield[y][x] == EMPTY_TILE)
+        mark_dirty (x, y);
+
+  furthest = settle_columns ();
+
+  /* Animate the fall a row at a time.  */
+  for (step = 1; step <= furthest; step++)
+    {
+      fall_step (step);
+      flush_dirty ();
+    }
+
+  if (!furthest)
+    flush_dirty ();
+}
+
+void
+make_special (uint8_t base, uint8_t *x)
+{
+  uint8_t candy = *x & 127;
+
+  if (TILE_KIND (candy) == KIND_PLAIN)
+    candy += base;
+  *x = candy;
+}
+
+static char
+special_candy (uint8_t x, uint8_t y, uint8_t h_score, uint8_t v_score)
+{
+  uint8_t *position = &playfield[y][x];
+
+  if (h_score >= 5 || v_score >= 5)
+    {
+      add_score (0x20);
+      set_tile (x, y, COLOURBOMB_TILE);
+    }
+  else if (h_score >= 3 && v_score >= 3)
+    {
+      add_score (0x20);
+      make_special (WRAP_TILES, position);
+    }
+  else if (h_score >= 4)
+    {
+      add_score (0x10);
+      make_special (H_TILES, position);
+    }
+  else if (v_score >= 4)
+    {
+      add_score (0x10);
+      make_special (V_TILES, position);
+    }
+  else
+    return 0;
+
+  return 1;
+}
+
+static uint8_t
+permitted_swap (uint8_t oldx, uint8_t oldy, uint8_t newx, uint8_t newy)
+{
+  uint8_t lhs = TILE_ATTR (playfield[oldy][oldx]);
+  uint8_t rhs = TILE_ATTR (playfield[newy][newx]);
+
+  /* Swapping a colour with itself isn't a "move".  */
+  if ((lhs & ATTR_COLOUR) != NO_COLOUR
+      && (lhs & ATTR_COLOUR) == (rhs & ATTR_COLOUR))
+    return 0;
+
+  /* Disallow illegal moves: anything but two candies needs a colour bomb or
+     a hole.  */
+  if (((lhs & ATTR_COLOUR) == NO_COLOUR || (rhs & ATTR_COLOUR) == NO_COLOUR)
+      && !((lhs | rhs) & ATTR_WILD))
+    return 0;
+
+  /* Can't swap with cages or swirls.  */
+  if ((background[oldy][oldx] & ~BG_MASK)
+      || (background[newy][newx] & ~BG_MASK))
+    return 0;
+
+  return 1;
+}
+
+uint8_t
+successful_move (uint8_t oldx, uint8_t oldy, uint8_t newx, uint8_t newy)
+{
+  uint8_t selected_tile;
+  uint8_t h_score = 0, v_score = 0, success = 0;
+
+  if (!permitted_swap (oldx, oldy, newx, newy))
+    return 0;
+
+  do_swap (oldx, oldy, newx, newy);
+
+  success = stripes_match (oldx, oldy, newx, newy, 1);
+
+  success |= colourbomb_match (&playfield[newy][newx],
+                               &playfield[oldy][oldx], 1);
+
+  selected_tile = playfield[newy][newx];
+  h_score = horizontal_match (newx, newy, selected_tile, 1);
+  v_score = vertical_match (newx, newy, selected_tile, 1);
+
+  success |= h_score >= 3 || v_score >= 3;
+  if (!special_candy (newx, newy, h_score, v_score))
+    add_score (0x05);
+
+  selected_tile = playfield[oldy][oldx];
+  h_score = horizontal_match (oldx, oldy, selected_tile, 1);
+  v_score = vertical_match (oldx, oldy, selected_tile, 1);
+
+  success |= h_score >= 3 || v_score >= 3;
+  if (!special_candy (oldx, oldy, h_score, v_score))
+    add_score (0x05);
+
+  if (success)
+    return 1;
+
+  /* Undo the move.  */
+  do_swap (oldx, oldy, newx, newy);
+
+  return 0;
+}
+
+static uint8_t
+move_is_possible (uint8_t oldx, uint8_t oldy, uint8_t newx, uint8_t newy)
+{
+  uint8_t success = 0;
+  
+  if (!permitted_swap (oldx, oldy, newx, newy))
+    return 0;
+  
+  if (stripes_match (oldx, oldy, newx, newy, 0))
+    return 1;
+
+  if (colourbomb_match (&playfield[newy][newx], &playfield[oldy][oldx], 0))
+    return 1;
+  
+  do_swap (oldx, oldy, newx, newy);
+#ifdef BITBOARDS
+  success = cell_in_run (oldx, oldy) || cell_in_run (newx, newy);
+#else
+  if (horizontal_match (oldx, oldy, playfield[oldy][oldx], 0) >= 3
+      || vertical_match (oldx, oldy, playfield[oldy][oldx], 0) >= 3
+      || horizontal_match (newx, newy, playfield[newy][newx], 0) >= 3
+      || vertical_match (newx, newy, playfield[newy][newx], 0) >= 3)
+    success = 1;
+#endif
+  do_swap (oldx, oldy, newx, newy);
+  return success;
+}
+
+/* The index of possible moves: bit X of hmove[Y] is set if swapping (X, Y)
+   with (X + 1, Y) would be a valid move, and likewise vmove[Y] for (X, Y)
+   and (X, Y + 1).  update_moves keeps it up to date by rechecking only the
+   swaps near cells which have changed since it last ran.  */
+static uint16_t hmove[9], vmove[9];
+static uint8_t move_count;
+
+/* The board as the index last saw it.  */
+static uint8_t indexed_fg[9][9], indexed_bg[9][9];
+
+/* Whether a swap can make a match depends on the cells up to two away from
+   either end, in the same row or column.  These are the bits within two
+   columns of each column.  */
+static const uint16_t near_bits[9] =
+  {
+    0x007, 0x00f, 0x01f, 0x03e, 0x07c, 0x0f8, 0x1f0, 0x1e0, 0x1c0
+  };
+
+void
+invalidate_moves (void)
+{
+  memset (indexed_bg, 255, sizeof (indexed_bg));
+}
+
+static void
+set_move (uint16_t *moves, uint8_t x, uint8_t possible)
+{
+  uint16_t was = *moves & cellbit[x];
+
+  if (possible && !was)
+    {
+      *moves |= cellbit[x];
+      move_count++;
+    }
+  else if (!possible && was)
+    {
+      *moves &= ~cellbit[x];
+      move_count--;
+    }
+}
+
+static void
+update_moves (void)
+{
+  uint16_t stale[9], hredo, vredo;
+  uint8_t x, y, i;
+
+  memset (stale, 0, sizeof (stale));
+
+  for (y = 0; y < 9; y++)
+    for (x = 0; x < 9; x++)
+      {
+        uint8_t fg = playfield[y][x] & 127, bg = background[y][x];
+
+        if (fg == indexed_fg[y][x] && bg == indexed_bg[y][x])
+          continue;
+
+        indexed_fg[y][x] = fg;
+        indexed_bg[y][x] = bg;
+
+        stale[y] |= near_bits[x];
+        for (i = y > 2 ? y - 2 : 0; i <= y + 2 && i < 9; i++)
+          stale[i] |= cellbit[x];
+      }
+
+  /* Recheck every swap with an end in a stale cell.  */
+  for (y = 0; y < 9; y++)
+    {
+      hredo = (stale[y] | (stale[y] >> 1)) & 0xff;
+      vredo = y < 8 ? stale[y] | stale[y + 1] : 0;
+
+      for (x = 0; x < 9; x++)
+        {
+          if (hredo & cellbit[x])
+            set_move (&hmove[y], x, move_is_possible (x, y, x + 1, y));
+          if (vredo & cellbit[x])
+            set_move (&vmove[y], x, move_is_possible (x, y, x, y + 1));
+        }
+    }
+}
+
+uint8_t
+reshuffle_needed (void)
+{
+  update_moves ();
+  return move_count == 0;
+}
+
+/* Rough values of what a move achieves, for choosing hints.  */
+#define VALUE_CANDY 2
+#define VALUE_JELLY 6
+#define VALUE_CAGE 6
+#define VALUE_SWIRL 4
+#define VALUE_BLAST 8
+#define VALUE_STRIPED 8
+#define VALUE_WRAPPED 12
+#define VALUE_BOMB 20
+
+/* How many cells from (X, Y) onwards, a step of (DX, DY) at a time, match
+   COLOUR.  */
+
+static uint8_t
+run_length (uint8_t x, uint8_t y, int8_t dx, int8_t dy, uint8_t colour)
+{
+  uint8_t n = 0;
+
+  while (1)
+    {
+      x += dx;
+      y += dy;
+      /* Off the edge (this catches -1 too).  */
+      if (x > 8 || y > 8 || TILE_COLOUR (playfield[y][x]) != colour)
+        return n;
+      n++;
+    }
+}
+
+/* What clearing (X, Y) is worth: the candy, any jelly or cage, swirls next
+   to it, and whatever a special candy there would set off.  */
+
+static uint8_t
+clear_value (uint8_t x, uint8_t y)
+{
+  uint8_t bg = background[y][x], value = VALUE_CANDY;
+
+  if ((bg & BG_MASK) >= 1 && (bg & BG_MASK) <= 2)
+    value += VALUE_JELLY;
+  if (bg & CAGE_MASK)
+    value += VALUE_CAGE;
+  if (TILE_ATTR (playfield[y][x]) & ATTR_SPECIAL)
+    value += VALUE_BLAST;
+
+  if (x > 0 && (background[y][x - 1] & SWIRL_MASK))
+    value += VALUE_SWIRL;
+  if (x < 8 && (background[y][x + 1] & SWIRL_MASK))
+    value += VALUE_SWIRL;
+  if (y > 0 && (background[y - 1][x] & SWIRL_MASK))
+    value += VALUE_SWIRL;
+  if (y < 8 && (background[y + 1][x] & SWIRL_MASK))
+    value += VALUE_SWIRL;
+
+  return value;
+}
+
+/* What the lines through (X, Y) are worth, once a swap has put a candy
+   there: the cells cleared, the special candy made (by the same rules as
+   special_candy), and a bit more the lower down they are, since more falls
+   on top and that tends to set off more matches.  */
+
+static uint16_t
+match_value (uint8_t x, uint8_t y)
+{
+  uint8_t colour = TILE_COLOUR (playfield[y][x]);
+  uint8_t left, right, up, down, across, along, i;
+  uint16_t value = 0;
+
+  if (colour == NO_COLOUR)
+    return 0;
+
+  left = run_length (x, y, -1, 0, colour);
+  right = run_length (x, y, 1, 0, colour);
+  up = run_length (x, y, 0, -1, colour);
+  down = run_length (x, y, 0, 1, colour);
+  across = left + right + 1;
+  along = up + down + 1;
+
+  if (across < 3 && along < 3)
+    return 0;
+
+  value = clear_value (x, y) + y + down;
+
+  if (across >= 3)
+    for (i = x - left; i <= x + right; i++)
+      if (i != x)
+        value += clear_value (i, y);
+
+  if (along >= 3)
+    for (i = y - up; i <= y + down; i++)
+      if (i != y)
+        value += clear_value (x, i);
+
+  if (across >= 5 || along >= 5)
+    value += VALUE_BOMB;
+  else if (across >= 3 && along >= 3)
+    value += VALUE_WRAPPED;
+  else if (across >= 4 || along >= 4)
+    value += VALUE_STRIPED;
+
+  return value;
+}
+
+/* Estimate what swapping (OLDX, OLDY) with (NEWX, NEWY) is worth.  The
+   board is put back as it was, and nothing is scored.  */
+
+static uint16_t
+move_value (uint8_t oldx, uint8_t oldy, uint8_t newx, uint8_t newy)
+{
+  uint8_t lhs = playfield[oldy][oldx], rhs = playfield[newy][newx];
+  uint8_t x, y, colour;
+  uint16_t value;
+
+  /* Two striped or wrapped candies: a row and a column each.  */
+  if (stripes_match (oldx, oldy, newx, newy, 0))
+    return VALUE_BOMB + 4 * 9 * VALUE_CANDY;
+
+  /* A colour bomb: every candy of the other one's colour.  */
+  if (colourbomb_match (&playfield[newy][newx], &playfield[oldy][oldx], 0))
+    {
+      colour = TILE_COLOUR (lhs == COLOURBOMB_TILE ? rhs : lhs);
+      value = VALUE_BOMB;
+      if (colour != NO_COLOUR)
+        for (y = 0; y < 9; y++)
+          for (x = 0; x < 9; x++)
+            if (TILE_COLOUR (playfield[y][x]) == colour)
+              value += clear_value (x, y);
+      return value;
+    }
+
+  do_swap (oldx, oldy, newx, newy);
+  value = match_value (oldx, oldy) + match_value (newx, newy);
+  do_swap (oldx, oldy, newx, newy);
+
+  return value;
+}
+
+/* Find the most valuable move from the index: (*X, *Y) swapped with the
+   cell to its right, or below it if *DOWN.  Returns 0 if there are no
+   moves.  */
+
+uint8_t
+best_move (uint8_t *bestx, uint8_t *besty, uint8_t *down)
+{
+  uint8_t x, y;
+  uint16_t value, best = 0;
+  uint8_t found = 0;
+
+  update_moves ();
+
+  for (y = 0; y < 9; y++)
+    for (x = 0; x < 9; x++)
+      {
+        if (hmove[y] & cellbit[x])
+          {
+            value = move_value (x, y, x + 1, y);
+            if (!found || value > best)
+              {
+                best = value;
+                *bestx = x;
+                *besty = y;
+                *down = 0;
+                found = 1;
+              }
+          }
+
+        if (vmove[y] & cellbit[x])
+          {
+            value = move_value (x, y, x, y + 1);
+            if (!found || value > best)
+              {
+                best = value;
+                *bestx = x;
+                *besty = y;
+                *down = 1;
+                found = 1;
+              }
+          }
+      }
+
+  return found;
+}
+
+/* Whether a valid move can be made at (X, Y) to (X + 3, Y): none of the
+   cells can be a hole or a swirl, and the two swapped can't be caged.  Nor
+   can any hold a special candy, which the player would lose; only plain
+   candies (or cells not filled in yet, 255) get recoloured.  */
+
+static uint8_t
+move_fits (uint8_t x, uint8_t y)
+{
+  uint8_t i, bg, tile;
+
+  for (i = 0; i < 4; i++)
+    {
+      bg = background[y][x + i];
+      tile = playfield[y][x + i];
+      if ((bg & SWIRL_MASK) || (bg & BG_MASK) == 3
+          || (i >= 2 && (bg & CAGE_MASK))
+          || (tile != 255 && TILE_KIND (tile) != KIND_PLAIN))
+        return 0;
+    }
+
+  return 1;
+}
+
+/* Make sure there's a move, by colouring four cells in a row A, A, B, A
+   (so swapping the last two makes a line of three).  The row is picked at
+   random.  Returns 0 if the level has nowhere to put it.  */
+
+static uint8_t
+plant_move (void)
+{
+  uint8_t i, x, y = rng_range (9), a, b;
+
+  for (i = 0; i < 9; i++)
+    {
+      for (x = 0; x < 6; x++)
+        if (move_fits (x, y))
+          {
+            a = rng ();
+            b = a == 5 ? 0 : a + 1;
+            set_tile (x, y, a);
+            set_tile (x + 1, y, a);
+            set_tile (x + 2, y, b);
+            set_tile (x + 3, y, a);
+            return 1;
+          }
+
+      if (++y == 9)
+        y = 0;
+    }
+
+  return 0;
+}
+
+/* The colours which would make a line of three in LINE (five cells, with
+   the one we're choosing in the middle), as a bit mask.  */
+
+static uint8_t
+line_colours (const uint8_t *line)
+{
+  uint8_t exclude = 0;
+
+  if (line[0] != NO_COLOUR && line[0] == line[1])
+    exclude |= 1 << line[0];
+  if (line[1] != NO_COLOUR && line[1] == line[3])
+    exclude |= 1 << line[1];
+  if (line[3] != NO_COLOUR && line[3] == line[4])
+    exclude |= 1 << line[3];
+
+  return exclude;
+}
+
+/* The colours which can't go at (X, Y) given the cells filled in so far.
+   Unfilled cells (255) have no colour.  */
+
+static uint8_t
+colours_in_line (uint8_t x, uint8_t y)
+{
+  uint8_t row[5], column[5], i;
+
+  for (i = 0; i < 5; i++)
+    {
+      row[i] = x + i >= 2 && x + i < 11
+               ? TILE_COLOUR (playfield[y][x + i - 2]) : NO_COLOUR;
+      column[i] = y + i >= 2 && y + i < 11
+                  ? TILE_COLOUR (playfield[y + i - 2][x]) : NO_COLOUR;
+    }
+
+  return line_colours (row) | line_colours (column);
+}
+
+/* Fill the board for the start of a level.  Each candy is chosen so it
+   doesn't make a line of three with those already placed (at most four
+   colours can be ruled out), after planting a move, so this always
+   finishes in one go.  */
+
+void
+generate_board (void)
+{
+  uint8_t x, y, tile, exclude;
+
+  memset (playfield, 255, sizeof (playfield));
+#ifdef BITBOARDS
+  memset (colour_bits, 0, sizeof (colour_bits));
+#endif
+
+  plant_move ();
+
+  for (y = 0; y < 9; y++)
+    for (x = 0; x < 9; x++)
+      {
+        if (playfield[y][x] != 255)
+          continue;
+
+        if (background[y][x] & SWIRL_MASK)
+          tile = SWIRL_TILE;
+        else if ((background[y][x] & BG_MASK) == 3)
+          tile = EMPTY_TILE;
+        else
+          {
+            exclude = colours_in_line (x, y);
+            tile = rng ();
+            while (exclude & (1 << tile))
+              tile = tile == 5 ? 0 : tile + 1;
+          }
+
+        set_tile (x, y, tile);
+      }
+}
+
+#define RESHUFFLE_TRIES 4
+
+/* Shuffle the candies when there are no moves left.  Each try is one
+   Fisher-Yates pass over the cells holding candies; if none of those
+   leaves a move, plant one.  */
+
+void
+shuffle_board (void)
+{
+  static uint8_t cells[81];
+  uint8_t *cp = &playfield[0][0];
+  uint8_t n = 0, i, j, tmp, tries;
+
+  for (i = 0; i < 81; i++)
+    if (TILE_COLOUR (cp[i]) != NO_COLOUR)
+      cells[n++] = i;
+
+  for (tries = 0; tries < RESHUFFLE_TRIES; tries++)
+    {
+      for (i = n; i > 1; i--)
+        {
+          j = rng_range (i);
+          tmp = cp[cells[i - 1]];
+          cp[cells[i - 1]] = cp[cells[j]];
+          cp[cells[j]] = tmp;
+        }
+
+#ifdef BITBOARDS
+      build_bitboards ();
+#endif
+
+      if (!reshuffle_needed ())
+        break;
+    }
+
+  if (tries == RESHUFFLE_TRIES)
+    plant_move ();
+}
+
+/* The runs of three or more matching candies on the board, as found by
+   find_runs: each cell holds the length of the horizontal (hrun) or
+   vertical (vrun) run it is part of, or 0, with RUN_START set on the first
+   cell of each run.  A cell in both kinds of run is the corner of an L or T
+   shape.  */
+static uint8_t hrun[9][9], vrun[9][9];
+
+#define RUN_START 0x80
+
+/* Work out runs along one row or column of COLOUR, STRIDE apart.  */
+
+static uint8_t
+find_line_runs (const uint8_t *colour, uint8_t *run, uint8_t stride)
+{
+  uint8_t i = 0, len, value, found = 0;
+
+  while (i < 9)
+    {
+      uint8_t c = *colour;
+      const uint8_t *next = colour + stride;
+      uint8_t *start = run;
+
+      for (len = 1; i + len < 9 && c != NO_COLOUR && *next == c; len++)
+        next += stride;
+
+      i += len;
+      colour = next;
+      value = len >= 3 ? len : 0;
+
+      for (; len > 0; len--)
+        {
+          *run = value;
+          run += stride;
+        }
+
+      if (value)
+        {
+          *start |= RUN_START;
+          found = 1;
+        }
+    }
+
+  return found;
+}
+
+/* Scan the whole board for matches.  Each row and column is walked once
+   (or not at all, if the bitboards show it has no runs), rather than
+   looking both ways from every cell.  */
+
+static uint8_t
+find_runs (void)
+{
+  static uint8_t colour[9][9];
+  uint8_t x, y, found = 0;
+  uint16_t rows = 0x1ff, columns = 0x1ff;
+
+#ifdef BITBOARDS
+  /* Find which rows and columns have any runs at all, by ANDing each
+     colour's cells with themselves shifted along by one and two.  Usually
+     that's none.  */
+  uint8_t c;
+  uint16_t *bits;
+
+  rows = columns = 0;
+  for (c = 0; c < 6; c++)
+    {
+      bits = colour_bits[c];
+      for (y = 0; y < 9; y++)
+        {
+          if (bits[y] & (bits[y] >> 1) & (bits[y] >> 2))
+            rows |= cellbit[y];
+          if (y < 7)
+            columns |= bits[y] & bits[y + 1] & bits[y + 2];
+        }
+    }
+
+  if (!rows && !columns)
+    return 0;
+
+  memset (hrun, 0, sizeof (hrun));
+  memset (vrun, 0, sizeof (vrun));
+#endif
+
+  for (y = 0; y < 9; y++)
+    for (x = 0; x < 9; x++)
+      colour[y][x] = TILE_COLOUR (playfield[y][x]);
+
+  for (y = 0; y < 9; y++)
+    if (rows & cellbit[y])
+      found |= find_line_runs (&colour[y][0], &hrun[y][0], 1);
+  for (x = 0; x < 9; x++)
+    if (columns & cellbit[x])
+      found |= find_line_runs (&colour[0][x], &vrun[0][x], 9);
+
+  return found;
+}
+
+/* Scanning from every cell of a run of N found it N times over, and each
+   time triggered all N cells, scoring a point apiece.  Keep the score the
+   same: this is the N * (N - 1) extra, in BCD.  */
+static const uint8_t run_bonus[10] =
+  {
+    0x00, 0x00, 0x02, 0x06, 0x12, 0x20, 0x30, 0x42, 0x56, 0x72
+  };
+
+static void
+fire_run (uint8_t x, uint8_t y, uint8_t len, uint8_t across)
+{
+  uint8_t eq = playfield[y][x], i;
+
+  len &= ~RUN_START;
+  for (i = 0; i < len; i++)
+    {
+      trigger (x, y, eq);
+      if (across)
+        x++;
+      else
+        y++;
+    }
+
+  add_score (run_bonus[len]);
+}
+
+uint8_t
+retrigger (void)
+{
+  uint8_t x, y;
+
+  if (!find_runs ())
+    return 0;
+
+  /* Fire runs in the order the old cell-by-cell scan found them, since
+     that decides which colour a colour bomb caught in a chain takes.  */
+  for (y = 0; y < 9; y++)
+    for (x = 0; x < 9; x++)
+      {
+        if (hrun[y][x] & RUN_START)
+          fire_run (x, y, hrun[y][x], 1);
+        if (vrun[y][x] & RUN_START)
+          fire_run (x, y, vrun[y][x], 0);
+      }
+
+  return 1;
+}
+
+uint8_t
+load_level (const uint8_t *levdata)
+{
+  memcpy (background, &levdata[1], 9 * 9);
+  invalidate_moves ();
+  return levdata[0];
+}
+
+uint8_t
+jelly_left (void)
+{
+  uint8_t cnt = 0;
+  uint8_t x, y;
+
+  for (y = 0; y < 9; y++)
+    for (x = 0; x < 9; x++)
+      {
+        uint8_t bg_tile = background[y][x] & BG_MASK;
+        if (bg_tile == 1 || bg_tile == 2)
+          cnt++;
+      }
+
+  return cnt;
+}
@@ -0,0 +1,79 @@
+/* The game rules: the board, matching, explosions, falling candies and the
+   move index.  None of this touches the screen, the OS or fixed addresses,
+   so it builds for the BBC (with render.c) or natively (with sim.c).  What
+   it needs from whichever front end it's linked with is declared at the
+   end.  */
+
+#ifndef RULES_H
+#define RULES_H
+
+typedef unsigned char uint8_t;
+typedef signed char int8_t;
+typedef unsigned short uint16_t;
+typedef signed short int16_t;
+
+#define PLAIN_TILES 0
+#define V_TILES 6
+#define H_TILES 12
+#define WRAP_TILES 18
+#define FIRST_NONCOLOUR 24
+#define SWIRL_TILE 24
+#define CAGE_TILE 25
+#define COLOURBOMB_TILE 26
+#define EXPLOSION_TILE 27
+#define BG_TILES 28
+
+#define SWIRL_MASK 0x80
+#define CAGE_MASK  0x40
+#define BG_MASK    0x3f
+
+#define EMPTY_TILE 31
+
+/* Keep a bit mask of each colour's cells alongside the playfield, for
+   finding matches a row at a time.  */
+#define BITBOARDS
+
+#define RNG_SEED 0xace1
+
+/* The candy in each cell (bit 7 set while it's exploding), and what's
+   under it: jelly (1 or 2), a hole (3), maybe with a cage or swirl.  */
+extern uint8_t playfield[9][9];
+extern uint8_t background[9][9];
+
+extern const uint16_t cellbit[9];
+
+extern void rng_seed (uint16_t seed);
+
+/* Start level data (the moves allowed, then the 81 background cells, as
+   tileconv writes them).  Returns the moves allowed.  */
+extern uint8_t load_level (const uint8_t *levdata);
+extern void generate_board (void);
+extern uint8_t jelly_left (void);
+
+extern void set_tile (uint8_t x, uint8_t y, uint8_t tile);
+extern void make_special (uint8_t base, uint8_t *x);
+
+/* A move, then the rounds of explosions it sets off.  */
+extern uint8_t successful_move (uint8_t oldx, uint8_t oldy, uint8_t newx,
+				uint8_t newy);
+extern void clear_explosions (void);
+extern void shuffle_explosions (void);
+extern void reset_playfield_marks (void);
+extern uint8_t retrigger (void);
+
+/* Forget the move index, so the next check rebuilds it.  */
+extern void invalidate_moves (void);
+extern uint8_t reshuffle_needed (void);
+extern void shuffle_board (void);
+extern uint8_t best_move (uint8_t *bestx, uint8_t *besty, uint8_t *down);
+
+/* Provided by the front end.  The rules call mark_dirty on cells whose
+   contents change, fall_by_copy when a candy falls a row into (X, Y), and
+   flush_dirty after each row of falling.  Points are BCD, e.g. 0x20 for
+   20.  */
+extern void mark_dirty (uint8_t x, uint8_t y);
+extern void fall_by_copy (uint8_t x, uint8_t y);
+extern void flush_dirty (void);
+extern void add_score (uint8_t points);
+
+#endif
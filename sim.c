@@ -0,0 +1,209 @@
+/* A headless front end for the game rules, to run natively (see mkhost.sh).
+   It loads the levels from tileconv's assembler output, plays them in turn
+   with best_move choosing every move, and reports how fast the rules ran.
+   There is nothing to draw, so the display hooks only count.  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "rules.h"
+
+#define MAX_LEVELS 64
+#define LEVEL_BYTES (1 + 9 * 9)
+
+static uint8_t levels[MAX_LEVELS][LEVEL_BYTES];
+static uint8_t filled_in[MAX_LEVELS];
+static unsigned num_levels;
+
+static unsigned long score;
+static unsigned long fall_rows;
+
+void
+mark_dirty (uint8_t x, uint8_t y)
+{
+}
+
+void
+fall_by_copy (uint8_t x, uint8_t y)
+{
+}
+
+void
+flush_dirty (void)
+{
+  fall_rows++;
+}
+
+void
+add_score (uint8_t points)
+{
+  score += (points >> 4) * 10 + (points & 15);
+}
+
+/* Pick out each "levelN:" and the .byte lines following it.  */
+
+static void
+load_levels (const char *filename)
+{
+  FILE *f = fopen (filename, "r");
+  char line[256];
+  unsigned num, filled = LEVEL_BYTES;
+  int value;
+  uint8_t *lev = NULL;
+
+  if (!f)
+    {
+      perror (filename);
+      exit (1);
+    }
+
+  while (fgets (line, sizeof (line), f))
+    {
+      if (sscanf (line, "level%u:", &num) == 1)
+        {
+          if (num < 1 || num > MAX_LEVELS)
+            {
+              fprintf (stderr, "%s: level%u out of range\n", filename, num);
+              exit (1);
+            }
+          lev = levels[num - 1];
+          filled = 0;
+          if (num > num_levels)
+            num_levels = num;
+        }
+      else if (filled < LEVEL_BYTES
+               && sscanf (line, " .byte %d", &value) == 1)
+        {
+          lev[filled++] = value;
+          filled_in[num - 1] = filled;
+        }
+    }
+
+  fclose (f);
+
+  if (!num_levels)
+    {
+      fprintf (stderr, "%s: no levels found\n", filename);
+      exit (1);
+    }
+
+  /* A level with no moves is missing (or wasn't finished).  */
+  for (num = 0; num < num_levels; num++)
+    if (!levels[num][0] || filled_in[num] != LEVEL_BYTES)
+      {
+        fprintf (stderr, "%s: level%u incomplete\n", filename, num + 1);
+        exit (1);
+      }
+}
+
+static unsigned long moves_made, cascades, reshuffles, levels_played;
+
+/* Clear one round of explosions and let everything fall.  */
+
+static void
+explode (void)
+{
+  clear_explosions ();
+  shuffle_explosions ();
+  reset_playfield_marks ();
+  cascades++;
+}
+
+/* Play a level until it's won or lost, or MAX_MOVES moves have been made
+   altogether.  The sequence is the same as play_level in render.c.  */
+
+static void
+play_level (uint8_t levelno, unsigned long max_moves)
+{
+  uint8_t moves = load_level (levels[levelno]);
+  uint8_t x, y, down;
+
+  generate_board ();
+  reset_playfield_marks ();
+
+  while (moves && jelly_left () && moves_made < max_moves)
+    {
+      if (!best_move (&x, &y, &down)
+          || !successful_move (x, y, x + !down, y + down))
+        {
+          fprintf (stderr, "level %u: no legal move\n", levelno + 1);
+          exit (1);
+        }
+
+      moves_made++;
+      explode ();
+
+      while (1)
+        {
+          while (retrigger ())
+            explode ();
+
+          if (!reshuffle_needed ())
+            break;
+
+          shuffle_board ();
+          reshuffles++;
+        }
+
+      moves--;
+    }
+
+  levels_played++;
+}
+
+int
+main (int argc, char *argv[])
+{
+  unsigned long max_moves = 100000;
+  uint16_t seed = RNG_SEED;
+  const char *filename = "tiles.s";
+  uint8_t levelno = 0;
+  clock_t start;
+  double secs;
+  int opt;
+
+  while ((opt = getopt (argc, argv, "n:s:")) != -1)
+    switch (opt)
+      {
+      case 'n':
+        max_moves = strtoul (optarg, NULL, 0);
+        break;
+      case 's':
+        seed = strtoul (optarg, NULL, 0);
+        break;
+      default:
+        fprintf (stderr, "usage: %s [-n moves] [-s seed] [tiles.s]\n",
+                 argv[0]);
+        return 1;
+      }
+
+  if (optind < argc)
+    filename = argv[optind];
+
+  load_levels (filename);
+  rng_seed (seed);
+
+  start = clock ();
+
+  while (moves_made < max_moves)
+    {
+      play_level (levelno, max_moves);
+      levelno = (levelno + 1) % num_levels;
+    }
+
+  secs = (double) (clock () - start) / CLOCKS_PER_SEC;
+  if (secs <= 0)
+    secs = 1e-6;
+
+  printf ("%u levels loaded, %lu played\n", num_levels, levels_played);
+  printf ("%lu moves, %lu cascade steps, %lu fall rows, %lu reshuffles\n",
+          moves_made, cascades, fall_rows, reshuffles);
+  printf ("score %lu\n", score);
+  printf ("%.3f s: %.0f moves/s, %.0f cascade steps/s\n", secs,
+          moves_made / secs, cascades / secs);
+
+  return 0;
+}
@@ -214,6 +214,137 @@ let write_block fo num eb =
       write_bytelist fo eb
   | _ -> List.iter (fun x -> write_span fo x) eb    
 
+(* Compiled tiles.  Rather than RLE data, a tile can be emitted as
+   straight-line code which stores its bytes directly to the screen.  The
+   three character rows a tile covers are addressed through three zero-page
+   pointers (set up by sprite_call in swram.S), with Y holding the byte
+   offset within the row.  *)
+
+type store =
+    Store of int * int
+  | Masked of int * int * int
+
+let tile_stores img tx ty =
+  let rows = Array.make 3 [] in
+  for x = 0 to 7 do
+    for y = 0 to 23 do
+      let lx = x * 2 in
+      let rx = lx + 1 in
+      let lpix = Rgba32.get img (tx + lx) (ty + y)
+      and rpix = Rgba32.get img (tx + rx) (ty + y) in
+      let row = y / 8
+      and offset = x * 8 + (y land 7) in
+      match colour_enc lpix, colour_enc rpix with
+        None, None -> ()
+      | Some l, None ->
+          rows.(row) <- Masked (offset, 0x55, (spread l) lsl 1) :: rows.(row)
+      | None, Some r ->
+          rows.(row) <- Masked (offset, 0xaa, spread r) :: rows.(row)
+      | Some l, Some r ->
+          rows.(row) <- Store (offset, mix l r) :: rows.(row)
+    done
+  done;
+  Array.map List.rev rows
+
+(* Returns the size of the code, in bytes.  *)
+
+let write_compiled_tile fo num img tx ty =
+  let rows = tile_stores img tx ty in
+  let size = ref 1 in
+  Printf.fprintf fo "spr%d:\n" num;
+  Array.iteri
+    (fun row stores ->
+      let ptr = Printf.sprintf "sprptr+%d" (row * 2) in
+      let cur_y = ref (-2) in
+      let set_y offset =
+        if offset = !cur_y + 1 then begin
+          Printf.fprintf fo "\tiny\n";
+          incr size
+        end else if offset <> !cur_y then begin
+          Printf.fprintf fo "\tldy #%d\n" offset;
+          size := !size + 2
+        end;
+        cur_y := offset in
+      (* Solid bytes are sorted by value so each distinct value is loaded
+         only once.  *)
+      let solids = List.fold_right
+        (fun st acc ->
+          match st with
+            Store (offset, byte) -> (byte, offset) :: acc
+          | Masked _ -> acc)
+        stores
+        [] in
+      let cur_a = ref (-1) in
+      List.iter
+        (fun (byte, offset) ->
+          if byte <> !cur_a then begin
+            Printf.fprintf fo "\tlda #%d\n" byte;
+            size := !size + 2;
+            cur_a := byte
+          end;
+          set_y offset;
+          Printf.fprintf fo "\tsta (%s),y\n" ptr;
+          size := !size + 2)
+        (List.sort compare solids);
+      List.iter
+        (function
+            Masked (offset, mask, byte) ->
+              set_y offset;
+              Printf.fprintf fo "\tlda (%s),y\n" ptr;
+              Printf.fprintf fo "\tand #%d\n" mask;
+              Printf.fprintf fo "\tora #%d\n" byte;
+              Printf.fprintf fo "\tsta (%s),y\n" ptr;
+              size := !size + 8
+          | Store _ -> ())
+        stores)
+    rows;
+  Printf.fprintf fo "\trts\n";
+  !size
+
+(* The sprite bank starts with a jump table indexed by tile number.  Tiles
+   which aren't compiled get a null entry (and a zero in sprite_map, so the
+   game never calls them).  The whole lot has to fit in the bank, from &8000
+   to &C000.  *)
+
+let sprite_bank_size = 0x4000
+
+let write_sprites fname img compiled =
+  let fo = open_out fname in
+  Printf.fprintf fo "\t.segment \"DATA\"\n";
+  Printf.fprintf fo "sprptr = $a8\n";
+  Printf.fprintf fo "sprite_table:\n";
+  let size = ref (2 * List.length tiles) in
+  List.iteri
+    (fun i _ ->
+      if compiled i then
+        Printf.fprintf fo "\t.word spr%d\n" i
+      else
+        Printf.fprintf fo "\t.word 0\n")
+    tiles;
+  List.iteri
+    (fun i (x, y) ->
+      if compiled i then
+        size := !size + write_compiled_tile fo i img (16 * x) (24 * y))
+    tiles;
+  close_out fo;
+  if !size > sprite_bank_size then
+    failwith (Printf.sprintf
+                "Compiled tiles take %d bytes, more than the %d in the bank"
+                !size sprite_bank_size)
+
+let parse_compile_spec = function
+    "all" -> (fun _ -> true)
+  | "none" | "" -> (fun _ -> false)
+  | spec ->
+      let ranges = List.map
+        (fun range ->
+          match String.split_on_char '-' range with
+            [n] -> int_of_string n, int_of_string n
+          | [lo; hi] -> int_of_string lo, int_of_string hi
+          | _ -> failwith ("Bad tile range " ^ range))
+        (String.split_on_char ',' spec) in
+      (fun n -> List.exists (fun (lo, hi) -> n >= lo && n <= hi) ranges)
+
 let levels =
   let s x = x lor 128 and c x = x lor 64 in
   [
@@ -322,10 +453,15 @@ let write_level fo lev num =
 
 let _ =
   let infile = ref ""
-  and outfile = ref "" in
+  and outfile = ref ""
+  and spritefile = ref ""
+  and compile_spec = ref "none" in
   let argspec =
-    ["-o", Arg.Set_string outfile, "Set output file"]
-  and usage = "Usage: fontconv infile -o outfile" in
+    ["-o", Arg.Set_string outfile, "Set output file";
+     "-s", Arg.Set_string spritefile, "Write compiled tiles to file";
+     "-c", Arg.Set_string compile_spec,
+       "Tiles to compile (e.g. 0-5,25,27, all or none)"]
+  and usage = "Usage: fontconv infile -o outfile [-s spritefile -c tiles]" in
   Arg.parse argspec (fun name -> infile := name) usage;
   if !infile = "" || !outfile = "" then begin
     Arg.usage argspec usage;
@@ -342,6 +478,9 @@ let _ =
       encoded::el)
     tiles
     [] in
+  let compiled = parse_compile_spec !compile_spec in
+  if !spritefile <> "" then
+    write_sprites !spritefile cinv compiled;
   let fo = open_out !outfile in
   Printf.fprintf fo "\t.segment \"DATA\"\n\t.export tiles\ntiles:\n";
   List.iteri
@@ -351,6 +490,7 @@ let _ =
   Printf.fprintf fo "\t.word jelly\n";
   Printf.fprintf fo "\t.word score\n";
   Printf.fprintf fo "\t.word moves\n";
+  Printf.fprintf fo "\t.word sprite_map\n";
   List.iteri
     (fun i _ ->
       Printf.fprintf fo "\t.word level%d\n" (i + 1))
@@ -360,6 +500,12 @@ let _ =
     (fun i encblock ->
       write_block fo i encblock)
     enclist;
+  Printf.fprintf fo "sprite_map:\n";
+  List.iteri
+    (fun i _ ->
+      let flag = if !spritefile <> "" && compiled i then 1 else 0 in
+      Printf.fprintf fo "\t.byte %d\n" flag)
+    tiles;
   Printf.fprintf fo "digits:\n";
   for y = 0 to 2 do
     for x = 0 to 3 do